@@ -34,6 +34,33 @@ public:
 	void map(mem::page_table_allocator &pta, u64 virtual_address, u64 physical_address, mapping_flags flags, mapping_size size = mapping_size::m4k);
 	void unmap(mem::page_table_allocator &pta, u64 virtual_address);
 
+	/**
+	 * Frees the page tables under the user part of a range of virtual addresses that
+	 * no longer map anything.
+	 *
+	 * @return - true if any tables were freed, in which case the caller must flush
+	 * the TLB (or invalidate any address), so that no cached entries of them remain
+	 */
+	bool reclaim_tables(mem::page_table_allocator &pta, u64 start, u64 end);
+
+	bool translate(u64 virtual_address, u64 &physical_address, mapping_size *size = nullptr) const;
+
+	/**
+	 * Invalidates this core's TLB entry for a virtual address.
+	 */
+	static void invalidate(u64 virtual_address) { asm volatile("invlpg (%0)" ::"r"(virtual_address) : "memory"); }
+
+	/**
+	 * Invalidates this core's TLB entries for every non-global mapping, by reloading
+	 * CR3.
+	 */
+	static void flush_tlb()
+	{
+		u64 cr3val;
+		asm volatile("mov %%cr3, %0" : "=r"(cr3val));
+		asm volatile("mov %0, %%cr3" ::"r"(cr3val) : "memory");
+	}
+
 	void dump() const;
 
 	u64 effective_cr3() const { return (u64)&pml4_ - 0xffff'8000'0000'0000; }
@@ -43,5 +70,8 @@ private:
 	DELETE_DEFAULT_COPY_AND_MOVE(x86_page_table)
 
 	pml4 pml4_;
+
+	base_entry *find_leaf(u64 virtual_address, mapping_size &size) const;
+	template <typename T> static bool table_empty(const T &table);
 } __packed;
 } // namespace stacsos::kernel::arch::x86
@@ -20,9 +20,39 @@ class debug_helper {
 	DEFINE_SINGLETON(debug_helper);
 
 private:
-	debug_helper() { }
+	debug_helper()
+		: symbols_(nullptr)
+		, nr_symbols_(0)
+		, symbol_names_(nullptr)
+		, symbols_loaded_(false)
+	{
+	}
 
 public:
 	void parse_image();
+
+	/**
+	 * Finds the kernel function containing an address.  The symbol table is loaded
+	 * from /boot/stacsos.sym (a copy of the kernel ELF, installed with the root
+	 * filesystem) the first time this is called.
+	 *
+	 * @param addr - The address to look up
+	 * @param offset - Set to the offset of addr from the start of the function
+	 * @return - The name of the function, or nullptr if it can't be found
+	 */
+	const char *lookup_symbol(u64 addr, u64 &offset);
+
+private:
+	struct kernel_symbol {
+		u64 address, size;
+		u32 name;
+	};
+
+	kernel_symbol *symbols_;
+	u64 nr_symbols_;
+	char *symbol_names_;
+	bool symbols_loaded_;
+
+	void load_symbols();
 };
 } // namespace stacsos::kernel
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+
+namespace stacsos::kernel::dev::misc {
+/**
+ * A device that reports the allocation profiler's counters as text, one line per
+ * call site, with the sites holding the most live memory first.  As with meminfo,
+ * a fresh snapshot is taken every time the file is read from the beginning.
+ */
+class allocprof : public device {
+public:
+	static device_class allocprof_device_class;
+
+	allocprof(bus &owner)
+		: device(allocprof_device_class, owner)
+	{
+	}
+
+	virtual void configure() override { }
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+};
+} // namespace stacsos::kernel::dev::misc
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+
+namespace stacsos::kernel::dev::misc {
+/**
+ * A device that reports the state of the page allocator and the slab caches as
+ * text.  A fresh snapshot is taken every time the file is read from the beginning,
+ * so a program can poll it while a workload runs.
+ */
+class meminfo : public device {
+public:
+	static device_class meminfo_device_class;
+
+	meminfo(bus &owner)
+		: device(meminfo_device_class, owner)
+	{
+	}
+
+	virtual void configure() override { }
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+};
+} // namespace stacsos::kernel::dev::misc
@@ -10,6 +10,7 @@
 #include <stacsos/kernel/fs/file.h>
 #include <stacsos/kernel/fs/filesystem.h>
 #include <stacsos/kernel/fs/fs-node.h>
+#include <stacsos/kernel/mem/kmem-cache.h>
 #include <stacsos/list.h>
 #include <stacsos/memory.h>
 
@@ -61,6 +62,8 @@ public:
 	{
 	}
 
+	DECLARE_KMEM_CACHE_OPERATORS()
+
 	virtual shared_ptr<file> open() override { return shared_ptr<file>(new tarfs_file((tar_filesystem &)fs(), data_start_, data_size_)); }
 	virtual fs_node *mkdir(const char *name) override;
 
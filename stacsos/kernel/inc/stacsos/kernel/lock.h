@@ -127,4 +127,27 @@ private:
 	u64 flags_;
 };
 
+/**
+ * Disables interrupts on the current core for as long as it is in scope, and then
+ * restores the previous interrupt state.  This is enough to protect data that is
+ * only ever touched by the current core, without taking a lock.
+ */
+class local_irq_guard {
+public:
+	local_irq_guard() { asm volatile("pushf; popq %0; cli" : "=r"(flags_)::"memory"); }
+
+	~local_irq_guard()
+	{
+		if (flags_ & (1 << 9)) {
+			asm volatile("sti" ::: "memory");
+		}
+	}
+
+	local_irq_guard(const local_irq_guard &) = delete;
+	local_irq_guard &operator=(const local_irq_guard &) = delete;
+
+private:
+	u64 flags_;
+};
+
 } // namespace stacsos::kernel
@@ -7,17 +7,18 @@
  */
 #pragma once
 
-namespace stacsos::kernel::mem {
-class page;
+#include <stacsos/kernel/mem/kmem-cache.h>
 
+namespace stacsos::kernel::mem {
 enum class region_flags { inaccessible = 0, readable = 1, writable = 2, executable = 4, readwrite = 3, all = 7 };
 
 DEFINE_ENUM_FLAG_OPERATIONS(region_flags)
 
 class address_space_region {
 public:
+	DECLARE_KMEM_CACHE_OPERATORS()
+
 	u64 base, size;
 	region_flags flags;
-	page *storage;
 };
 } // namespace stacsos::kernel::mem
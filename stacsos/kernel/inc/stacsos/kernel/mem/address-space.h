@@ -7,22 +7,62 @@
  */
 #pragma once
 
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/address-space-region.h>
 #include <stacsos/kernel/mem/page-table.h>
-#include <stacsos/list.h>
+#include <stacsos/avl-tree.h>
 
 namespace stacsos::kernel::mem {
+class page;
 class page_table_allocator;
 class memory_manager;
 
+/**
+ * Describes a page fault.  The bits are those of the x86 page fault error code, so
+ * that it can be passed straight through.
+ */
+enum class page_fault_flags { none = 0, present = 1, write = 2, user = 4, fetch = 16 };
+
+DEFINE_ENUM_FLAG_OPERATIONS(page_fault_flags)
+
+struct address_space_stats {
+	u64 nr_regions;
+
+	// The pages covered by regions, and the pages of those that are backed.  A page
+	// shared copy-on-write is counted by every address space that maps it.
+	u64 committed_pages;
+	u64 resident_pages;
+};
+
+/**
+ * A page table, and the regions of it that are in use.  A region is either backed
+ * by physical memory (exactly as many pages as it covers) when it is added, or
+ * (when allocate is false) on demand: its pages are only allocated, zeroed and
+ * mapped when they are first touched, so that large, sparsely used regions (such
+ * as stacks and heaps) only cost what is used.
+ *
+ * Once a region exists, the pages mapped in it belong to the page table, which can
+ * share them with other address spaces copy-on-write (see clone()).  A shared page
+ * is mapped read-only everywhere, and its descriptor counts the extra sharers.
+ *
+ * Regions are kept in a tree keyed by base address, so that finding the region for
+ * a fault, checking a new region for overlap, and finding a gap for alloc_region()
+ * all take O(log n).  Adjacent regions with the same permissions are merged, so a
+ * process that grows its heap one allocation at a time still has few regions.
+ */
 class address_space {
 	friend class memory_manager;
 
 public:
+	// The end of the user part of the address space (the lower canonical half).
+	static const u64 user_space_end = 0x8000'0000'0000;
+
 	address_space(page_table_allocator &pta, u64 alloc_rgn_start)
 		: pta_(pta)
 		, pt_(page_table::create_empty(pta))
-		, next_alloc_rgn_(alloc_rgn_start)
+		, alloc_rgn_start_(alloc_rgn_start)
+		, committed_pages_(0)
+		, resident_pages_(0)
 	{
 	}
 
@@ -30,35 +70,116 @@ public:
 
 	page_table &pgtable() const { return *pt_; }
 
-	address_space_region *alloc_region(u64 size, region_flags flags, bool allocate);
+	/**
+	 * Adds a region in the lowest gap (above the allocation start) that is large
+	 * enough.
+	 *
+	 * @return - The base address of the region, or zero if there is no room
+	 */
+	u64 alloc_region(u64 size, region_flags flags, bool allocate);
+
+	/**
+	 * Adds a region at a fixed address.  The size is rounded up to whole pages.
+	 *
+	 * @return - The region now covering the range (which may be a larger region it
+	 * has been merged into), or nullptr if it overlaps an existing region
+	 */
 	address_space_region *add_region(u64 base, u64 size, region_flags flags, bool allocate);
-	void remove_region(u64 base, u64 size, region_flags flags);
+
+	/**
+	 * Removes a (page-aligned) range of addresses from the address space, and gives
+	 * back the memory that was mapped in it.  The range may cover any number of
+	 * regions, or parts of them.
+	 *
+	 * @return - true if any of the range was in a region
+	 */
+	bool remove_region(u64 base, u64 size);
+
+	/**
+	 * Handles a page fault on an address in this address space, by backing the page
+	 * if it is in an on-demand region and the access is allowed.
+	 *
+	 * @return - true if the fault was handled, and the access can be retried
+	 */
+	bool handle_fault(u64 address, page_fault_flags flags);
+
+	/**
+	 * Backs the page containing an address (in an on-demand region) now, as if it had
+	 * been touched, so that the kernel can fill it in through the direct map.
+	 *
+	 * @return - The page now mapped at the address, or nullptr if it isn't in a region
+	 * or there is no memory
+	 */
+	page *populate_page(u64 address);
 
 	address_space_region *get_region_from_address(u64 address)
 	{
-		for (address_space_region *rgn : regions_) {
-			if (address >= rgn->base && address < (rgn->base + rgn->size)) {
-				return rgn;
-			}
-		}
-
-		return nullptr;
+		unique_irq_lock l(lock_);
+		return find_region(address);
 	}
 
 	address_space *create_linked(u64 alloc_rgn_start);
 
+	/**
+	 * Makes a copy-on-write duplicate of this (user) address space.  Both address
+	 * spaces get the same regions, and share every page that is mapped, read-only.
+	 * The first write to a shared page (from either side) gives the writer its own
+	 * copy, so nothing is copied up front.
+	 *
+	 * @return - The duplicate, which shares the kernel's mappings like any other
+	 */
+	address_space *clone();
+
+	void get_stats(address_space_stats &stats) const;
+
+	static void perform_selftest();
+
 private:
 	address_space(page_table_allocator &pta, page_table *pt, u64 alloc_rgn_start)
 		: pta_(pta)
 		, pt_(pt)
-		, next_alloc_rgn_(alloc_rgn_start)
+		, alloc_rgn_start_(alloc_rgn_start)
+		, committed_pages_(0)
+		, resident_pages_(0)
 	{
 	}
 
 	page_table_allocator &pta_;
 	page_table *pt_;
 
-	list<address_space_region *> regions_;
-	u64 next_alloc_rgn_;
+	// Protects the region list and the user part of the page table, which are also
+	// changed by the page fault handler.
+	mutable spinlock_irq lock_;
+
+	// Maps the base address of each region -> the region.
+	avl_tree<u64, address_space_region *> regions_;
+	u64 alloc_rgn_start_;
+	u64 committed_pages_, resident_pages_;
+
+	address_space_region *find_region(u64 address) const
+	{
+		u64 base;
+		address_space_region *rgn;
+		if (regions_.try_get_floor(address, base, rgn) && address < base + rgn->size) {
+			return rgn;
+		}
+
+		return nullptr;
+	}
+
+	bool overlaps_region(u64 base, u64 size) const;
+	u64 find_gap(u64 size) const;
+	address_space_region *insert_region(u64 base, u64 size, region_flags flags, bool allocate);
+	void merge_next(address_space_region &rgn);
+
+	bool populate_range(u64 base, u64 size, region_flags flags);
+	bool populate_block(u64 address, int order, mapping_flags flags, u64 &mapped);
+	void unmap_range(u64 start, u64 end);
+
+	page *map_zeroed_page(address_space_region &rgn, u64 address);
+	page *unshare_page(address_space_region &rgn, u64 address);
+
+	static mapping_flags mapping_flags_of(region_flags rgn_flags);
+	static mapping_flags mapping_flags_of(const address_space_region &rgn) { return mapping_flags_of(rgn.flags); }
 };
 } // namespace stacsos::kernel::mem
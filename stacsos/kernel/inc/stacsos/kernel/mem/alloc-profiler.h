@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+
+namespace stacsos::kernel::mem {
+class memory_manager;
+
+enum class alloc_kind : u32 { object, pages };
+
+/**
+ * The counters for one call site, i.e. one place in the kernel that calls the object
+ * or page allocator.
+ */
+struct alloc_site_stats {
+	void *caller;
+	alloc_kind kind;
+
+	// The size (in bytes) and size class (or page order) of the latest allocation
+	// from this site.  The size class is -1 for large objects and page runs.
+	u32 last_size;
+	int size_class;
+
+	u64 allocations, frees;
+	u64 live_bytes, total_bytes;
+};
+
+/**
+ * Records kernel allocations by call site, so that leaks and heavy users can be
+ * found.  Sites are kept in a fixed-size hash table, keyed by the caller's return
+ * address, and each live allocation is kept in a second table so that a free can
+ * be charged back to the site that made the allocation.  When either table is full,
+ * further sites (or allocations) go uncounted, and the number dropped is reported.
+ *
+ * Profiling is enabled with the "allocprof=yes" boot option.  When it's disabled,
+ * there is no profiler at all, and the allocators only pay for a null check.
+ */
+class alloc_profiler {
+public:
+	static const u64 nr_sites = 1024;
+	static const u64 nr_tracked_allocations = 16384;
+
+	/**
+	 * Creates the profiler in pages of its own, taken from the page allocator.
+	 */
+	static alloc_profiler *create(memory_manager &mm);
+
+	void record_alloc(alloc_kind kind, void *caller, const void *ptr, u64 size, int size_class);
+	void record_free(const void *ptr);
+
+	/**
+	 * Copies the counters of every site into the given array.
+	 *
+	 * @return - The number of sites copied
+	 */
+	u64 snapshot(alloc_site_stats *sites, u64 max_sites) const;
+
+	u64 start_time() const { return start_time_; }
+	u64 dropped_sites() const { return dropped_sites_; }
+	u64 untracked_allocations() const { return untracked_allocations_; }
+
+private:
+	alloc_profiler();
+
+	struct tracked_allocation {
+		const void *ptr;
+		u32 site;
+		u32 size;
+	};
+
+	mutable spinlock_irq lock_;
+	u64 start_time_;
+	u64 dropped_sites_, untracked_allocations_;
+
+	alloc_site_stats sites_[nr_sites];
+	tracked_allocation allocations_[nr_tracked_allocations];
+
+	static u64 hash(const void *ptr) { return ((uintptr_t)ptr * 0x9e37'79b9'7f4a'7c15ull) >> 40; }
+
+	alloc_site_stats *find_site(void *caller, alloc_kind kind);
+	bool track(const void *ptr, u32 site, u64 size);
+	bool untrack(const void *ptr, u32 &site, u64 &size);
+};
+} // namespace stacsos::kernel::mem
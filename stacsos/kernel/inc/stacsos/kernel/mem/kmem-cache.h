@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/shrinker.h>
+#include <stacsos/kernel/mem/slab-cache.h>
+#include <stacsos/memops.h>
+#include <stacsos/helpers.h>
+
+namespace stacsos::kernel::mem {
+
+static const size_t cache_line_size = 64;
+
+/**
+ * The untyped part of a kmem_cache.  Every cache is kept on a list (for reporting
+ * and shrinking), and has a slab cache id from a range above the object allocator's
+ * size classes, so that an object can be traced back to its cache from its page.
+ */
+class kmem_cache_base {
+public:
+	static const u32 first_cache_id = 64;
+	static const u32 max_caches = 192;
+
+	kmem_cache_base(const char *name);
+
+	const char *name() const { return name_; }
+	kmem_cache_base *next() const { return next_; }
+
+	virtual size_t object_size() const = 0;
+	virtual void *alloc_object() = 0;
+	virtual void free_object(void *obj) = 0;
+	virtual u64 shrink() = 0;
+	virtual void get_stats(slab_cache_stats &stats) = 0;
+
+	static kmem_cache_base *first() { return caches_; }
+
+	/**
+	 * @return - The cache with the given slab cache id, or nullptr if there is none
+	 */
+	static kmem_cache_base *find(u32 cache_id);
+
+	/**
+	 * @return - A shrinker that shrinks every kmem_cache, for registering with the
+	 * memory manager
+	 */
+	static shrinker &all_caches_shrinker();
+
+protected:
+	u32 id_;
+
+private:
+	const char *name_;
+	kmem_cache_base *next_;
+
+	static kmem_cache_base *caches_;
+	static kmem_cache_base *by_id_[max_caches];
+	static u32 nr_caches_;
+};
+
+/**
+ * A named cache of objects of one type, for kernel objects that are allocated and
+ * freed often enough to deserve their own slabs.  Objects are padded to the given
+ * alignment (a cache line by default), so that two hot objects never share a line.
+ *
+ * A cache can also keep its free objects constructed, so that T's (default)
+ * constructor runs once per slot when the slab is created, and the destructor once
+ * when it is released.  alloc() then returns an object in the state that free()
+ * was given it, which saves re-initialising objects with expensive set-up (such as
+ * embedded locks and lists).  create() and destroy() must not be used with such a
+ * cache.
+ *
+ * Types normally use their cache through DECLARE_KMEM_CACHE_OPERATORS and
+ * DEFINE_KMEM_CACHE_OPERATORS, so that plain new and delete go to the cache.
+ */
+template <class T, size_t alignment = cache_line_size, bool constructed = false> class kmem_cache : public kmem_cache_base {
+private:
+	static constexpr size_t round_up(size_t v, size_t to) { return (v + to - 1) & ~(to - 1); }
+
+	// A constructed object can't be overwritten by the free-list link, so the link
+	// goes after it.
+	static constexpr size_t link_offset = constructed ? round_up(sizeof(T), sizeof(void *)) : 0;
+	static constexpr size_t slot_size = round_up(sizeof(T) > link_offset + sizeof(void *) ? sizeof(T) : link_offset + sizeof(void *), alignment);
+
+	// Use enough pages that a slab holds at least eight objects.
+	static constexpr int slab_page_order = slot_size <= PAGE_SIZE / 8 ? 0 : slot_size <= PAGE_SIZE / 4 ? 1 : slot_size <= PAGE_SIZE / 2 ? 2 : 3;
+
+	static_assert((alignment & (alignment - 1)) == 0, "alignment must be a power of two");
+	static_assert(slot_size * 8 <= (PAGE_SIZE << slab_page_order) || slab_page_order == 3, "objects too large for a kmem cache");
+
+public:
+	kmem_cache(const char *name)
+		: kmem_cache_base(name)
+		, cache_(id_, 2, constructor_hook(), destructor_hook())
+	{
+	}
+
+	/**
+	 * @return - Memory for (or, in a constructed cache, an already constructed) T
+	 */
+	T *alloc()
+	{
+		void *obj = cache_.allocate(lock_);
+		if (!obj) {
+			panic("out of memory for %s", name());
+		}
+
+		return (T *)obj;
+	}
+
+	void free(T *obj)
+	{
+		if (!obj) {
+			return;
+		}
+
+		unique_irq_lock l(lock_);
+		cache_.free(obj);
+	}
+
+	template <typename... Args> T *create(Args &&...args)
+	{
+		static_assert(!constructed, "objects in a constructed cache are already constructed");
+		return new (alloc()) T(forward<Args>(args)...);
+	}
+
+	void destroy(T *obj)
+	{
+		static_assert(!constructed, "objects in a constructed cache are already constructed");
+
+		obj->~T();
+		free(obj);
+	}
+
+	/**
+	 * For class-specific operator new.  Objects of a class derived from T are larger
+	 * than T, and so come from the object allocator instead.
+	 */
+	void *alloc_sized(size_t size) { return size == sizeof(T) ? alloc() : ::operator new(size); }
+	void free_sized(void *obj, size_t size) { size == sizeof(T) ? free((T *)obj) : ::operator delete(obj); }
+
+	virtual size_t object_size() const override { return sizeof(T); }
+	virtual void *alloc_object() override { return alloc(); }
+	virtual void free_object(void *obj) override { free((T *)obj); }
+
+	virtual u64 shrink() override
+	{
+		unique_irq_lock l(lock_);
+		return cache_.shrink();
+	}
+
+	virtual void get_stats(slab_cache_stats &stats) override
+	{
+		memops::bzero(&stats, sizeof(stats));
+
+		unique_irq_lock l(lock_);
+		cache_.get_stats(stats);
+	}
+
+private:
+	spinlock_irq lock_;
+	slab_cache<slot_size, slab_page_order, link_offset> cache_;
+
+	static slab_object_hook constructor_hook()
+	{
+		if constexpr (constructed) {
+			return [](void *obj) { new (obj) T(); };
+		} else {
+			return nullptr;
+		}
+	}
+
+	static slab_object_hook destructor_hook()
+	{
+		if constexpr (constructed) {
+			return [](void *obj) { ((T *)obj)->~T(); };
+		} else {
+			return nullptr;
+		}
+	}
+};
+} // namespace stacsos::kernel::mem
+
+/**
+ * Declares class-specific operator new and delete, inside the class definition, so
+ * that objects of the class come from a kmem_cache.
+ */
+#define DECLARE_KMEM_CACHE_OPERATORS()                                                                                                                         \
+	static void *operator new(size_t size);                                                                                                                    \
+	static void *operator new(size_t size, void *ptr) { return ptr; }                                                                                          \
+	static void operator delete(void *ptr, size_t size);
+
+/**
+ * Defines the kmem_cache for a class, and the operators that use it.
+ */
+#define DEFINE_KMEM_CACHE_OPERATORS(__class_typename, __cache_name)                                                                                            \
+	static stacsos::kernel::mem::kmem_cache<__class_typename> __class_typename##_cache(__cache_name);                                                        \
+	void *__class_typename::operator new(size_t size) { return __class_typename##_cache.alloc_sized(size); }                                                  \
+	void __class_typename::operator delete(void *ptr, size_t size) { __class_typename##_cache.free_sized(ptr, size); }
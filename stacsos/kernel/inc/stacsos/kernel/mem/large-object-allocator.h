@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <stacsos/avl-tree.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 #include <stacsos/kernel/mem/page-table-allocator.h>
 
@@ -16,6 +17,22 @@ struct object_header {
 	u8 data[];
 };
 
+/**
+ * Allocates objects too large for the slab caches, by mapping pages into a dedicated
+ * region of the kernel address space.  An object is backed by one physically
+ * contiguous block for each set bit of its page count (largest first), falling back
+ * to smaller blocks when a large one isn't available.  Objects of 2 MiB or more are
+ * placed on a 2 MiB boundary, so that their large blocks can be mapped with 2 MiB
+ * pages, which need far fewer page-table updates and TLB entries.
+ *
+ * Each allocation is recorded in a tree keyed by address, so that it can be unmapped
+ * and its pages returned when it is freed.  Freed virtual ranges are coalesced and
+ * reused (best-fit), and a range at the top of the used part of the region is given
+ * back to it entirely.
+ *
+ * The tree nodes come from the library node caches, which are slab-backed, so they
+ * never come back here.
+ */
 class large_object_allocator {
 public:
 	large_object_allocator(void *region_base, size_t region_size)
@@ -28,11 +45,52 @@ public:
 	void *allocate(size_t size);
 	bool free(void *ptr);
 
+	/**
+	 * @return - The size (in bytes, a whole number of pages) of the allocation
+	 * starting at ptr, or zero if there isn't one
+	 */
+	size_t size_of(void *ptr);
+
+	/**
+	 * Grows an allocation in place, by backing the pages that follow it, if they
+	 * aren't in use.
+	 *
+	 * @return - true if the allocation is now at least size bytes
+	 */
+	bool grow(void *ptr, size_t size);
+
 	bool ptr_in_region(void *ptr) const { return ((uintptr_t)ptr >= (uintptr_t)region_base_) && ((uintptr_t)ptr < ((uintptr_t)region_base_ + size_)); }
 
 private:
+	static const int huge_page_order = 9;
+	static const u64 huge_page_pages = 1ull << huge_page_order;
+
 	void *region_base_;
 	void *base_;
 	size_t size_;
+
+	// Maps the first page (as an index into the region) of each allocation -> its
+	// page count.
+	avl_tree<u64, u64> allocations_;
+
+	// Free ranges below base_, by first page index -> page count, and by
+	// (page count << 32) | first page index, with no data.
+	avl_tree<u64, u64> free_by_address_;
+	avl_tree<u64, u64> free_by_size_;
+
+	static u64 size_key(u64 index, u64 page_count) { return (page_count << 32) | index; }
+
+	u64 address_of(u64 index) const { return (u64)region_base_ + (index << PAGE_BITS); }
+	u64 index_of(void *ptr) const { return ((uintptr_t)ptr - (uintptr_t)region_base_) >> PAGE_BITS; }
+
+	bool take_range(u64 page_count, u64 alignment, u64 &index);
+	void release_range(u64 index, u64 page_count);
+	void add_free_range(u64 index, u64 page_count);
+	void remove_free_range(u64 index, u64 page_count);
+
+	bool populate_range(u64 index, u64 page_count);
+	bool populate(u64 index, int order, u64 &mapped);
+	void map_block(u64 index, page &block, int order);
+	void unmap_pages(u64 index, u64 page_count);
 };
 } // namespace stacsos::kernel::mem
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+
+namespace stacsos::kernel::mem {
+
+/**
+ * A magazine is a small stack of free objects (rounds) of one size, which a core
+ * can allocate from and free to without taking any locks.  Magazines are sized to
+ * fit in a 128-byte object.
+ */
+struct magazine {
+	static const u64 capacity = 14;
+
+	magazine()
+		: next(nullptr)
+		, rounds(0)
+	{
+	}
+
+	bool empty() const { return rounds == 0; }
+	bool full() const { return rounds == capacity; }
+
+	void *pop() { return objects[--rounds]; }
+	void push(void *obj) { objects[rounds++] = obj; }
+
+	magazine *next;
+	u64 rounds;
+	void *objects[capacity];
+};
+
+static_assert(sizeof(magazine) == 128, "magazines must fit in a 128-byte object");
+
+/**
+ * The depot holds the magazines that aren't loaded on any core, for one object
+ * size: full ones, for cores that have run out of objects, and empty ones, for
+ * cores that have too many.
+ */
+class magazine_depot {
+public:
+	magazine_depot()
+		: full_(nullptr)
+		, empty_(nullptr)
+		, nr_full_(0)
+		, nr_empty_(0)
+	{
+	}
+
+	magazine *take_full()
+	{
+		unique_irq_lock l(lock_);
+		return pop(full_, nr_full_);
+	}
+
+	magazine *take_empty()
+	{
+		unique_irq_lock l(lock_);
+		return pop(empty_, nr_empty_);
+	}
+
+	void put_full(magazine *mag)
+	{
+		unique_irq_lock l(lock_);
+		push(full_, nr_full_, mag);
+	}
+
+	void put_empty(magazine *mag)
+	{
+		unique_irq_lock l(lock_);
+		push(empty_, nr_empty_, mag);
+	}
+
+	u64 nr_full() const { return nr_full_; }
+	u64 nr_empty() const { return nr_empty_; }
+
+private:
+	spinlock_irq lock_;
+	magazine *full_, *empty_;
+	u64 nr_full_, nr_empty_;
+
+	static magazine *pop(magazine *&list, u64 &count)
+	{
+		magazine *mag = list;
+		if (mag) {
+			list = mag->next;
+			mag->next = nullptr;
+			count--;
+		}
+
+		return mag;
+	}
+
+	static void push(magazine *&list, u64 &count, magazine *mag)
+	{
+		mag->next = list;
+		list = mag;
+		count++;
+	}
+};
+} // namespace stacsos::kernel::mem
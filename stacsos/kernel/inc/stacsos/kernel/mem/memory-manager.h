@@ -7,23 +7,41 @@
  */
 #pragma once
 
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/address-space.h>
 #include <stacsos/kernel/mem/object-allocator.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 #include <stacsos/kernel/mem/page-table-allocator.h>
+#include <stacsos/kernel/mem/shrinker.h>
 
 namespace stacsos::kernel::mem {
+class page_allocator_percore;
+class alloc_profiler;
+
 class memory_manager {
 	DEFINE_SINGLETON(memory_manager)
 
 private:
 	memory_manager()
 		: pgalloc_(nullptr)
+		, percore_pgalloc_(nullptr)
+		, profiler_(nullptr)
 		, root_address_space_(nullptr)
+		, nr_page_descriptors_(0)
+		, pgalloc_init_cycles_(0)
+		, next_deferred_pfn_(0)
+		, shrinkers_(nullptr)
 	{
 	}
 
 public:
+	/**
+	 * The granularity (in pages) of deferred page descriptor initialisation.  This is
+	 * the size of the largest buddy block, so that looking for a free buddy never
+	 * touches a section that hasn't been initialised yet.
+	 */
+	static const u64 deferred_section_pages = 1ull << 16;
+
 	static void add_memory_block(u64 start, u64 length, bool avail);
 
 	void init();
@@ -36,20 +54,47 @@ public:
 	object_allocator &objalloc() { return objalloc_; }
 	const object_allocator &objalloc() const { return objalloc_; }
 
+	/**
+	 * @return - The allocation profiler, or nullptr if profiling isn't enabled
+	 */
+	alloc_profiler *profiler() const { return profiler_; }
+
 	address_space &root_address_space() const { return *root_address_space_; }
 
-	bool try_handle_page_fault(u64 faulting_address);
+	u64 nr_page_descriptors() const { return nr_page_descriptors_; }
+	u64 pgalloc_init_cycles() const { return pgalloc_init_cycles_; }
+
+	bool try_handle_page_fault(address_space &as, u64 faulting_address, page_fault_flags flags);
+
+	bool initialise_deferred_section();
+	bool perform_idle_work();
+
+	void register_shrinker(shrinker &s);
+	u64 run_shrinkers();
 
 private:
-	void initialise_page_descriptors(u64 nr_page_descriptors);
-	void initialise_page_allocator(u64 nr_page_descriptors);
+	void initialise_page_descriptors(u64 start_pfn, u64 end_pfn);
+	void initialise_page_allocator(u64 nr_initial_pfns);
+	void populate_page_allocator(u64 start_pfn, u64 end_pfn);
 	void initialise_object_allocator();
+	void initialise_profiler();
+	void *allocate_dynamic_data(u64 size);
 	void activate_primary_mapping();
 
 	page_allocator *pgalloc_;
+	page_allocator_percore *percore_pgalloc_;
 	page_table_allocator ptalloc_;
 	object_allocator objalloc_;
+	alloc_profiler *profiler_;
 
 	address_space *root_address_space_;
+	u64 nr_page_descriptors_;
+	u64 pgalloc_init_cycles_;
+
+	spinlock_irq deferred_init_lock_;
+	u64 next_deferred_pfn_;
+
+	spinlock_irq shrinkers_lock_;
+	shrinker *shrinkers_;
 };
 } // namespace stacsos::kernel::mem
@@ -7,31 +7,187 @@
  */
 #pragma once
 
+#include <stacsos/kernel/arch/core-manager.h>
 #include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/large-object-allocator.h>
+#include <stacsos/kernel/mem/magazine.h>
+#include <stacsos/kernel/mem/shrinker.h>
 #include <stacsos/kernel/mem/slab-cache.h>
 
 namespace stacsos::kernel::mem {
 class memory_manager;
+class alloc_profiler;
 
-class object_allocator {
+struct size_class {
+	size_t object_size;
+	int slab_page_order;
+};
+
+/**
+ * The object allocator's size classes, smallest first.  Between the powers of two
+ * there are classes half way up, so that no object wastes more than a third of its
+ * slot.  The larger classes use multi-page slabs, so that the space left over at
+ * the end of a slab (and taken by the slab header) is a small fraction of it.
+ * Anything larger than the last class goes to the large object allocator.
+ */
+static constexpr size_class size_classes[] = {
+	{ 16, 0 },
+	{ 32, 0 },
+	{ 48, 0 },
+	{ 64, 0 },
+	{ 96, 0 },
+	{ 128, 0 },
+	{ 192, 0 },
+	{ 256, 0 },
+	{ 384, 1 },
+	{ 512, 1 },
+	{ 768, 2 },
+	{ 1024, 2 },
+	{ 1536, 3 },
+	{ 2048, 3 },
+	{ 4096, 3 },
+};
+
+static constexpr int nr_size_classes = sizeof(size_classes) / sizeof(size_classes[0]);
+static constexpr size_t size_class_granule = 16;
+static constexpr size_t max_size_class_size = size_classes[nr_size_classes - 1].object_size;
+
+/**
+ * Maps an object size, in granules (rounded up), to its size class.  This is built
+ * at compile time from the table above.
+ */
+struct size_class_index {
+	constexpr size_class_index()
+		: classes()
+	{
+		u8 size_class = 0;
+
+		for (size_t granules = 0; granules <= max_size_class_size / size_class_granule; granules++) {
+			while (size_classes[size_class].object_size < granules * size_class_granule) {
+				size_class++;
+			}
+
+			classes[granules] = size_class;
+		}
+	}
+
+	u8 classes[max_size_class_size / size_class_granule + 1];
+};
+
+static constexpr size_class_index size_class_lookup;
+
+static_assert(nr_size_classes < 64, "size class ids must not overlap kmem cache ids");
+static_assert(size_class_lookup.classes[(64 + 15) / 16] == 3 && size_class_lookup.classes[(1100 + 15) / 16] == 12);
+
+template <int sc> using size_class_cache = slab_cache<size_classes[sc].object_size, size_classes[sc].slab_page_order>;
+
+/**
+ * A slab cache for each size class, from sc upwards.  Each level of the chain holds
+ * one cache, as each has a different type.
+ */
+template <int sc> struct size_class_caches : size_class_caches<sc + 1> {
+	size_class_caches()
+		: cache(sc + 1)
+	{
+	}
+
+	size_class_cache<sc> cache;
+};
+
+template <> struct size_class_caches<nr_size_classes> { };
+
+/**
+ * Allocates kernel objects.  Small objects come from one of a set of slab caches,
+ * which are fronted by a per-core magazine layer (after Bonwick): each core keeps
+ * a loaded and a previous magazine for each size class, so most allocations and
+ * frees only touch per-core state, with interrupts briefly disabled.  Cores swap
+ * full and empty magazines through a per-size-class depot, and only go to the
+ * slab caches (under the allocator lock) when the depot can't help.
+ *
+ * The object allocator is also a shrinker: under memory pressure, it flushes the
+ * magazines it can reach and gives empty slabs back to the page allocator.
+ */
+class object_allocator : public shrinker {
 public:
 	object_allocator();
 
-	void *alloc(size_t size);
-	void *realloc(void *obj, size_t size);
+	static const int nr_size_classes = mem::nr_size_classes;
+
+	/**
+	 * @param caller - The call site to charge the allocation to, when profiling.  If
+	 * not given, it is the caller of this function.
+	 */
+	void *alloc(size_t size, void *caller = nullptr);
+
+	/**
+	 * Resizes an object, in place if its slot (for a small object) or its pages (for
+	 * a large one) can hold the new size, and otherwise by moving it.
+	 *
+	 * @return - The (possibly moved) object, or nullptr if there is no memory for it, in
+	 * which case the original object is left alone
+	 */
+	void *realloc(void *obj, size_t size, void *caller = nullptr);
 	void free(void *obj);
 
+	void set_profiler(alloc_profiler *profiler) { profiler_ = profiler; }
+
+	void get_stats(int size_class, slab_cache_stats &stats);
+
+	virtual u64 shrink() override;
+
 private:
+	// Only touched by the owning core, so the counters don't need to be atomic.
+	struct core_magazines {
+		core_magazines()
+			: loaded(nullptr)
+			, previous(nullptr)
+			, hits(0)
+			, depot_hits(0)
+			, misses(0)
+			, requested_bytes(0)
+		{
+		}
+
+		magazine *loaded, *previous;
+		u64 hits, depot_hits, misses;
+
+		// The sizes actually asked for, for measuring internal fragmentation.
+		u64 requested_bytes;
+	};
+
+	// Protects the slab caches.  Slab pages are allocated without holding this, as
+	// the page allocator may call back into shrink().
 	spinlock_irq object_allocator_lock_;
+	spinlock_irq large_object_lock_;
 
-	slab_cache<16, 0> cache16_;
-	slab_cache<32, 0> cache32_;
-	slab_cache<64, 0> cache64_;
-	slab_cache<128, 0> cache128_;
-	slab_cache<256, 0> cache256_;
-	slab_cache<512, 0> cache512_;
-	slab_cache<1024, 0> cache1024_;
+	size_class_caches<0> caches_;
 	large_object_allocator loa_;
+
+	alloc_profiler *profiler_;
+
+	magazine_depot depots_[nr_size_classes];
+	core_magazines magazines_[arch::core_manager::max_cores][nr_size_classes];
+
+	static int size_class_of(size_t size)
+	{
+		return size <= max_size_class_size ? size_class_lookup.classes[(size + size_class_granule - 1) / size_class_granule] : -1;
+	}
+
+	void *allocate(size_t size, int size_class);
+	bool resize_in_place(void *obj, size_t size, size_t &old_size);
+
+	core_magazines &this_core_magazines(int size_class);
+
+	void *magazine_alloc(int size_class, size_t size);
+	void magazine_free(int size_class, void *obj);
+
+	magazine *new_magazine();
+	void release_magazine(int size_class, magazine *mag);
+	void flush_magazines(int size_class);
+
+	void *slab_alloc(int size_class);
+	void slab_free(int size_class, void *obj);
+
+	template <int sc = 0, class F> auto with_cache(int size_class, F fn);
 };
 } // namespace stacsos::kernel::mem
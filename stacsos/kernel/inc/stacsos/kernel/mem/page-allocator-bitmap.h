@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/mem/page-allocator.h>
+
+namespace stacsos::kernel::mem {
+
+/**
+ * A page allocator that tracks free memory with one bit per page, rather than by
+ * walking page descriptors.  The bitmap is summarised by two further levels: each
+ * bit in level one describes a 64-page word of level zero, and each bit in level
+ * two describes 4096 pages.  Two sets of summaries are kept, one recording whether
+ * a word has any free pages, and one recording whether all of its pages are free,
+ * so that the starts and ends of free runs can both be found without scanning
+ * every word.
+ *
+ * Allocations are first-fit from the lowest address, and may be of any number of
+ * pages (see allocate_page_run).  Order-based allocations are naturally aligned.
+ */
+class page_allocator_bitmap : public page_allocator {
+public:
+	static u64 metadata_size(u64 nr_pages);
+
+	page_allocator_bitmap(memory_manager &mm, void *metadata, u64 nr_pages);
+
+	virtual void insert_pages(page &range_start, u64 page_count) override;
+	virtual void remove_pages(page &range_start, u64 page_count) override;
+
+	virtual page *allocate_pages(int order, page_allocation_flags flags = page_allocation_flags::none) override;
+	virtual void free_pages(page &base, int order) override;
+
+	virtual page *allocate_page_run(u64 page_count, page_allocation_flags flags = page_allocation_flags::none) override;
+	virtual void free_page_run(page &base, u64 page_count) override;
+
+	virtual void dump() const override;
+	virtual void get_stats(page_allocator_stats &stats) const override;
+
+private:
+	static const int nr_levels = 3;
+	static const u64 npos = ~0ull;
+
+	u64 nr_pages_;
+	u64 nr_words_[nr_levels];
+
+	// Level zero is shared: a set bit means the page is free.  Above that, any_free_
+	// bits are set when the word below is non-zero, and all_free_ bits are set when
+	// the word below is all ones.
+	u64 *any_free_[nr_levels];
+	u64 *all_free_[nr_levels];
+
+	u64 total_free_;
+	u64 total_pages_;
+	u64 allocations_, frees_, failures_;
+
+	u64 nr_bits(int level) const { return level ? nr_words_[level - 1] : nr_pages_; }
+
+	u64 find_next(u64 *const *levels, u64 invert, int level, u64 index) const;
+	u64 find_next_free(u64 pfn) const { return find_next(any_free_, 0, 0, pfn); }
+	u64 find_next_allocated(u64 pfn) const;
+
+	u64 find_free_run(u64 page_count, u64 alignment) const;
+
+	u64 mark_range(u64 pfn, u64 page_count, bool free);
+	void update_summaries(u64 word);
+};
+} // namespace stacsos::kernel::mem
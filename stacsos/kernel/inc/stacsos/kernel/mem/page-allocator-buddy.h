@@ -10,41 +10,92 @@
 #include <stacsos/kernel/mem/page-allocator.h>
 
 namespace stacsos::kernel::mem {
-    class page_allocator_buddy : public page_allocator {
-    public:
-        page_allocator_buddy(memory_manager &mm)
-                : page_allocator(mm)
-        {
-            for (int i = 0; i <= LastOrder; i++) {
-                free_list_[i] = nullptr;
-            }
-        }
 
-        virtual void insert_pages(page &range_start, u64 page_count) override;
-        virtual void remove_pages(page &range_start, u64 page_count) override;
+/**
+ * A binary buddy page allocator.  To stop long-lived kernel allocations from
+ * breaking up the memory that large allocations need, memory is grouped into
+ * pageblocks (of 2^pageblock_order pages), each of which has a migrate type, and
+ * there is a separate set of free lists for each migrate type.  A free block is
+ * always on the lists for the type of the pageblock that it starts in.
+ *
+ * Allocations are served from the lists for their own migrate type where possible.
+ * Otherwise, the largest block available in the other type is stolen, and if it
+ * covers a large enough part of a pageblock, the whole pageblock is converted to
+ * the new type.
+ */
+class page_allocator_buddy : public page_allocator {
+public:
+	page_allocator_buddy(memory_manager &mm)
+		: page_allocator(mm)
+		, total_free_(0)
+		, total_pages_(0)
+		, allocations_(0)
+		, frees_(0)
+		, failures_(0)
+		, splits_(0)
+		, merges_(0)
+		, fallbacks_(0)
+	{
+		for (int t = 0; t < nr_migrate_types; t++) {
+			nonempty_orders_[t] = 0;
+
+			for (int i = 0; i <= LastOrder; i++) {
+				free_list_[t][i] = nullptr;
+				free_list_tail_[t][i] = nullptr;
+			}
+		}
+
+		for (int i = 0; i <= LastOrder; i++) {
+			free_blocks_[i] = 0;
+		}
+	}
+
+	virtual void insert_pages(page &range_start, u64 page_count) override;
+	virtual void remove_pages(page &range_start, u64 page_count) override;
+
+	virtual page *allocate_pages(int order, page_allocation_flags flags = page_allocation_flags::none) override;
+	virtual void free_pages(page &base, int order) override;
+
+	virtual void dump() const override;
+	virtual void get_stats(page_allocator_stats &stats) const override;
+
+	page *find_free_block(page &pg, int &order) const;
+
+private:
+	static const int LastOrder = 16;
+	static_assert(LastOrder < page_allocator_stats::nr_orders);
+
+	static const int pageblock_order = page::pageblock_order;
+
+	page *free_list_[nr_migrate_types][LastOrder + 1];
+	page *free_list_tail_[nr_migrate_types][LastOrder + 1];
+	u32 nonempty_orders_[nr_migrate_types];
+	u64 total_free_;
+	u64 total_pages_;
 
-        virtual page *allocate_pages(int order, page_allocation_flags flags = page_allocation_flags::none) override;
-        virtual void free_pages(page &base, int order) override;
+	u64 free_blocks_[LastOrder + 1];
+	u64 allocations_, frees_, failures_, splits_, merges_, fallbacks_;
 
-        virtual void dump() const override;
+	constexpr u64 pages_per_block(int order) const { return 1ull << order; }
 
-        virtual int find_order(page &range_start) const;
-        virtual int find_index(int order, page &range_start) const;
+	constexpr bool block_aligned(int order, u64 pfn) const { return !(pfn & (pages_per_block(order) - 1)); }
 
-    private:
-        static const int LastOrder = 16;
+	bool is_free_block(int order, u64 pfn) const;
 
-        page *free_list_[LastOrder + 1];
-        u64 total_free_;
+	migrate_type block_type(const page &block_start) const { return block_start.pageblock_type(); }
 
-        constexpr u64 pages_per_block(int order) const { return 1 << order; }
+	void link_free_block(migrate_type type, int order, page &block_start, bool at_tail);
+	void unlink_free_block(migrate_type type, int order, page &block_start);
 
-        constexpr bool block_aligned(int order, u64 pfn) { return !(pfn & (pages_per_block(order) - 1)); }
+	void add_free_block(int order, page &block_start, bool at_tail);
+	void insert_free_block(int order, page &block_start) { add_free_block(order, block_start, false); }
+	void append_free_block(int order, page &block_start) { add_free_block(order, block_start, true); }
+	void remove_free_block(int order, page &block_start);
 
-        void insert_free_block(int order, page &block_start);
-        void remove_free_block(int order, page &block_start);
+	page *merge_buddies(int order, page &block_start);
 
-        void split_block(int order, page &block_start);
-        void merge_buddies(int order, page &buddy);
-    };
-} // namespace stacsos::kernel::mem
\ No newline at end of file
+	page *steal_block(int order, migrate_type type, int &block_order);
+	u64 count_free_pages_in_pageblock(u64 pageblock_pfn) const;
+	void move_pageblock(u64 pageblock_pfn, migrate_type type);
+};
+} // namespace stacsos::kernel::mem
@@ -7,17 +7,24 @@
  */
 #pragma once
 
+#include <stacsos/avl-tree.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 
 namespace stacsos::kernel::mem {
 
+/**
+ * A page allocator that keeps free memory as a set of extents (runs of free pages),
+ * which are coalesced with their neighbours when pages are freed.  The extents are
+ * indexed twice: by start PFN, to find the neighbours of a freed range, and by
+ * (size, start PFN), so that allocations are best-fit.  Power-of-two blocks of
+ * 2 MiB or more are naturally aligned, as buddy blocks would be.
+ *
+ * The tree nodes can't come from the object allocator, as that is built on top of
+ * the page allocator, so they are carved out of pages taken from this allocator.
+ */
 class page_allocator_linear : public page_allocator {
 public:
-	page_allocator_linear(memory_manager &mm)
-		: page_allocator(mm)
-		, free_list_(nullptr)
-	{
-	}
+	page_allocator_linear(memory_manager &mm);
 
 	virtual void insert_pages(page &range_start, u64 page_count) override;
 	virtual void remove_pages(page &range_start, u64 page_count) override;
@@ -25,9 +32,64 @@ public:
 	virtual page *allocate_pages(int order, page_allocation_flags flags = page_allocation_flags::none) override;
 	virtual void free_pages(page &base, int order) override;
 
+	virtual page *allocate_page_run(u64 page_count, page_allocation_flags flags = page_allocation_flags::none) override;
+	virtual void free_page_run(page &base, u64 page_count) override;
+
 	virtual void dump() const override;
+	virtual void get_stats(page_allocator_stats &stats) const override;
 
 private:
-	page *free_list_;
+	using extent_node = avl_tree_node<u64, u64>;
+
+	struct extent_node_allocator {
+		page_allocator_linear *owner;
+
+		extent_node *allocate(const u64 &key, const u64 &data) { return owner->alloc_node(key, data); }
+		void free(extent_node *n) { owner->free_node(n); }
+	};
+
+	struct spare_node {
+		spare_node *next;
+	};
+
+	// Blocks of at least this order (2 MiB) are allocated on a multiple of their size.
+	static const int aligned_block_order = 9;
+
+	// Enough nodes for the boot-time memory map, before any pages can be taken for more.
+	static const u64 nr_bootstrap_nodes = 128;
+
+	// Each operation needs at most this many new nodes, so the pool is topped up
+	// beforehand whenever it falls below this.
+	static const u64 node_reserve = 8;
+
+	// Maps start PFN -> page count.
+	avl_tree<u64, u64, extent_node_allocator> by_address_;
+
+	// Keyed by (page count << 32) | start PFN, with no data.  Both fit in 32 bits,
+	// as there are at most page::max_nr_pages pages.
+	avl_tree<u64, u64, extent_node_allocator> by_size_;
+
+	spare_node *spare_nodes_;
+	u64 nr_spare_nodes_;
+	alignas(extent_node) u8 bootstrap_nodes_[nr_bootstrap_nodes * sizeof(extent_node)];
+
+	u64 total_free_;
+	u64 total_pages_;
+	u64 allocations_, frees_, failures_;
+
+	static u64 size_key(u64 pfn, u64 page_count) { return (page_count << 32) | pfn; }
+
+	extent_node *alloc_node(const u64 &key, const u64 &data);
+	void free_node(extent_node *n);
+	void add_spare_nodes(void *storage, u64 size);
+	void reserve_nodes();
+
+	void add_extent(u64 pfn, u64 page_count);
+	void remove_extent(u64 pfn, u64 page_count);
+
+	page *allocate_run(u64 page_count, u64 alignment, page_allocation_flags flags);
+
+	u64 take_pages(u64 page_count, u64 alignment);
+	void release_pages(u64 pfn, u64 page_count);
 };
 } // namespace stacsos::kernel::mem
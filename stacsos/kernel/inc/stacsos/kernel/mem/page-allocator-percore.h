@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+
+namespace stacsos::kernel::mem {
+
+/**
+ * A page allocator that sits in front of another (backing) page allocator, and
+ * keeps a small cache of single pages for each core.  Order-0 allocations and frees
+ * are satisfied from the local cache where possible, which is refilled from (and
+ * drained to) the backing allocator in batches.  Recently freed pages are handed
+ * out first (hot), and the pages that have been in the cache longest (cold) are the
+ * first to be drained.  Each core has a separate cache for each migrate type, so
+ * that cached pages go back to (and come from) pageblocks of the right type.
+ *
+ * The backing allocator is protected by a lock, so this is also the layer that
+ * makes the page allocator safe to call from more than one core.
+ *
+ * A shared pool of pre-zeroed movable pages is also kept here, so that movable
+ * single-page allocations asking for zeroed memory don't have to clear the page
+ * themselves.  The pool is topped up in the background (see refill_zeroed_pool).
+ */
+class page_allocator_percore : public page_allocator {
+public:
+	static const u64 batch_size = 16;
+	static const u64 low_watermark = 0;
+	static const u64 high_watermark = 64;
+
+	static const u64 zeroed_pool_target = 256;
+	static const u64 zeroed_pool_batch = 8;
+
+	page_allocator_percore(memory_manager &mm, page_allocator &backing)
+		: page_allocator(mm)
+		, backing_(backing)
+	{
+	}
+
+	virtual void insert_pages(page &range_start, u64 page_count) override;
+	virtual void remove_pages(page &range_start, u64 page_count) override;
+
+	virtual page *allocate_pages(int order, page_allocation_flags flags = page_allocation_flags::none) override;
+	virtual void free_pages(page &base, int order) override;
+
+	virtual page *allocate_page_run(u64 page_count, page_allocation_flags flags = page_allocation_flags::none) override;
+	virtual void free_page_run(page &base, u64 page_count) override;
+
+	virtual void dump() const override;
+	virtual void get_stats(page_allocator_stats &stats) const override;
+
+	page_allocator &backing() const { return backing_; }
+
+	void drain_all();
+
+	u64 refill_zeroed_pool(u64 max_pages);
+	u64 zeroed_pool_size() const { return zeroed_pool_.count; }
+
+private:
+	struct page_cache {
+		page_cache()
+			: hot(nullptr)
+			, cold(nullptr)
+			, count(0)
+		{
+		}
+
+		spinlock_irq lock;
+		page *hot, *cold;
+		u64 count;
+	};
+
+	// Allocation counters are kept per core (and updated atomically, as they aren't
+	// protected by a lock), so that counting doesn't bounce a shared cache line.
+	struct core_counters {
+		core_counters()
+			: allocations(0)
+			, frees(0)
+			, failures(0)
+		{
+		}
+
+		u64 allocations, frees, failures;
+	};
+
+	page_allocator &backing_;
+	mutable spinlock_irq backing_lock_;
+	page_cache caches_[arch::core_manager::max_cores][nr_migrate_types];
+	page_cache zeroed_pool_;
+	core_counters counters_[arch::core_manager::max_cores];
+
+	page_cache &this_core_cache(migrate_type type);
+	core_counters &this_core_counters();
+	static void count_event(u64 &counter) { __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED); }
+
+	page *allocate(int order, page_allocation_flags flags);
+
+	void push_hot(page_cache &cache, page &pg);
+	void push_cold(page_cache &cache, page &pg);
+	page *pop_hot(page_cache &cache);
+	page *pop_cold(page_cache &cache);
+
+	bool make_memory_available(int attempt);
+
+	page *take_cached_page(migrate_type type);
+	page *take_zeroed_page();
+
+	void refill(page_cache &cache, migrate_type type);
+	void drain(page_cache &cache, u64 count);
+};
+} // namespace stacsos::kernel::mem
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/mem/page-allocator.h>
+
+namespace stacsos::kernel::mem {
+class alloc_profiler;
+
+/**
+ * A page allocator that passes everything through to another, and tells the
+ * allocation profiler about each allocation and free.  This is only put in front of
+ * the page allocator when profiling is enabled, so that it costs nothing otherwise.
+ */
+class page_allocator_profiling : public page_allocator {
+public:
+	page_allocator_profiling(memory_manager &mm, page_allocator &backing, alloc_profiler &profiler)
+		: page_allocator(mm)
+		, backing_(backing)
+		, profiler_(profiler)
+	{
+	}
+
+	virtual void insert_pages(page &range_start, u64 page_count) override { backing_.insert_pages(range_start, page_count); }
+	virtual void remove_pages(page &range_start, u64 page_count) override { backing_.remove_pages(range_start, page_count); }
+
+	virtual page *allocate_pages(int order, page_allocation_flags flags = page_allocation_flags::none) override;
+	virtual void free_pages(page &base, int order) override;
+
+	virtual page *allocate_page_run(u64 page_count, page_allocation_flags flags = page_allocation_flags::none) override;
+	virtual void free_page_run(page &base, u64 page_count) override;
+
+	virtual void dump() const override { backing_.dump(); }
+	virtual void get_stats(page_allocator_stats &stats) const override { backing_.get_stats(stats); }
+
+private:
+	page_allocator &backing_;
+	alloc_profiler &profiler_;
+};
+} // namespace stacsos::kernel::mem
@@ -14,10 +14,45 @@ namespace stacsos::kernel::mem {
 class page;
 class memory_manager;
 
-enum class page_allocation_flags { none = 0, zero = 1 };
+enum class page_allocation_flags { none = 0, zero = 1, movable = 2 };
 
 DEFINE_ENUM_FLAG_OPERATIONS(page_allocation_flags)
 
+/**
+ * Returns the migrate type that an allocation with the given flags should come
+ * from.  Allocations are unmovable unless they say otherwise.
+ */
+static inline migrate_type migrate_type_of(page_allocation_flags flags)
+{
+	if ((flags & page_allocation_flags::movable) == page_allocation_flags::movable) {
+		return migrate_type::movable;
+	}
+
+	return migrate_type::unmovable;
+}
+
+/**
+ * A snapshot of the state of a page allocator.  Free block counts are per order,
+ * and the event counters run from boot.
+ */
+struct page_allocator_stats {
+	static const int nr_orders = 17;
+
+	u64 total_pages;
+	u64 free_pages;
+	u64 cached_pages;
+	u64 free_blocks[nr_orders];
+
+	u64 allocations;
+	u64 frees;
+	u64 failures;
+	u64 splits;
+	u64 merges;
+	u64 fallbacks;
+
+	int fragmentation_index(int order) const;
+};
+
 class page_allocator {
 public:
 	page_allocator(memory_manager &mm)
@@ -31,15 +66,24 @@ public:
 	virtual page *allocate_pages(int order, page_allocation_flags flags = page_allocation_flags::none) = 0;
 	virtual void free_pages(page &base, int order) = 0;
 
+	virtual page *allocate_page_run(u64 page_count, page_allocation_flags flags = page_allocation_flags::none);
+	virtual void free_page_run(page &base, u64 page_count);
+
 	page_alloc_ref allocate_pages_ref(int order, page_allocation_flags flags = page_allocation_flags::none)
 	{
 		return page_alloc_ref(allocate_pages(order, flags), order);
 	}
 
 	virtual void dump() const = 0;
+	virtual void get_stats(page_allocator_stats &stats) const;
 
 	void perform_selftest();
 
+protected:
+	memory_manager &mm() const { return mm_; }
+
+	page *prepare_pages(page *block_start, u64 page_count, page_allocation_flags flags);
+
 private:
 	memory_manager &mm_;
 };
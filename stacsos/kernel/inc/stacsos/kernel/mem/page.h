@@ -11,36 +11,117 @@ extern "C" void *_DYNAMIC_DATA_START;
 
 namespace stacsos::kernel::mem {
 enum class page_type : u32 { none, reserved, system, allocable };
-enum class page_state : u32 { free, allocated };
+enum class page_state : u32 { none, free, allocated };
+
+/**
+ * Whether the contents of a page can be moved.  Zero is movable, so that freshly
+ * initialised memory starts out movable.
+ */
+enum class migrate_type : u32 { movable, unmovable };
+static const int nr_migrate_types = 2;
 
 class memory_manager;
 class page_allocator_buddy;
 class page_allocator_linear;
+class page_allocator_percore;
 
 class page {
 	friend class memory_manager;
 	friend class page_allocator_buddy;
 	friend class page_allocator_linear;
+	friend class page_allocator_percore;
 
 public:
+	/**
+	 * The number of pages that can be described, limited by the size of the free-list links.
+	 */
+	static const u64 max_nr_pages = 0xffff'ffffull;
+
+	/**
+	 * Memory is grouped into pageblocks of this order, each with its own migrate type.
+	 */
+	static const int pageblock_order = 9;
+
 	static page &get_from_pfn(u64 pfn) { return get_pagearray()[pfn]; }
 	static page &get_from_base_address(u64 base_addr) { return get_pagearray()[base_addr >> PAGE_BITS]; }
+	static page &get_from_ptr(const void *ptr) { return get_from_base_address((u64)ptr - 0xffff'8000'0000'0000ull); }
 
 	u64 pfn() const { return ((u64)this - (u64)get_pagearray()) / sizeof(page); }
 	u64 base_address() const { return pfn() << PAGE_BITS; }
 	void *base_address_ptr() const { return (void *)(base_address() + 0xffff'8000'0000'0000ull); }
 
-	u64 refcount() const { return refcount_; }
+	page &pageblock() const { return get_from_pfn(pfn() & ~((1ull << pageblock_order) - 1)); }
+	migrate_type pageblock_type() const { return pageblock().pageblock_type_; }
+
+	/**
+	 * The number of references to the page besides the first, e.g. the number of
+	 * extra address spaces sharing it copy-on-write.
+	 */
+	u32 refcount() const { return refcount_; }
 	void acquire() { refcount_++; }
-	bool release() { return !(refcount_--); }
+
+	/**
+	 * Drops a reference to the page.
+	 *
+	 * @return - true if that was the last reference, and the page can be freed
+	 */
+	bool release()
+	{
+		if (!refcount_) {
+			return true;
+		}
+
+		refcount_--;
+		return false;
+	}
+
+	u32 slab_cache_id() const { return slab_cache_id_; }
+	page &slab_head() const { return get_from_pfn(pfn() - slab_offset_); }
+
+	/**
+	 * Records that this page is the given page of a slab belonging to the given cache.
+	 */
+	void set_slab(u32 cache_id, u32 offset)
+	{
+		slab_cache_id_ = cache_id;
+		slab_offset_ = offset;
+	}
 
 private:
 	static page *get_pagearray() { return reinterpret_cast<page *>(&_DYNAMIC_DATA_START); }
 
-	page_type type_;
-	page_state state_;
-	page *next_free_;
-	u64 free_block_size_;
-	u64 refcount_;
+	// Free-list links are stored as PFN + 1, so that a zeroed descriptor has no links.
+	static u32 page_to_link(const page *pg) { return pg ? (u32)(pg->pfn() + 1) : 0; }
+	static page *link_to_page(u32 link) { return link ? &get_from_pfn(link - 1) : nullptr; }
+
+	page *next_free() const { return link_to_page(next_free_); }
+	page *prev_free() const { return link_to_page(prev_free_); }
+	void set_next_free(page *pg) { next_free_ = page_to_link(pg); }
+	void set_prev_free(page *pg) { prev_free_ = page_to_link(pg); }
+
+	page_type type_ : 2;
+	page_state state_ : 2;
+	u32 order_ : 5;
+
+	// Only meaningful in the first page of a pageblock.
+	migrate_type pageblock_type_ : 2;
+
+	// The object cache that a slab page belongs to, or zero if it isn't a slab page.
+	u32 slab_cache_id_ : 8;
+
+	u32 next_free_;
+
+	// Slab pages are never on a free list, so they reuse the link.
+	union {
+		u32 prev_free_;
+		u32 slab_offset_;
+	};
+
+	union {
+		u32 free_block_size_;
+		u32 refcount_;
+	};
 };
+
+static_assert(sizeof(page) <= 16, "page descriptors must be no larger than 16 bytes");
 } // namespace stacsos::kernel::mem
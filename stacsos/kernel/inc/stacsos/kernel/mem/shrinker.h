@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos::kernel::mem {
+class memory_manager;
+
+/**
+ * Something that holds on to memory it doesn't strictly need (e.g. empty slabs),
+ * and can give it back to the page allocator when asked.  Shrinkers are registered
+ * with the memory manager, and are run when the page allocator is about to fail
+ * an allocation.  They are called with no memory manager locks held.
+ */
+class shrinker {
+	friend class memory_manager;
+
+public:
+	shrinker()
+		: next_shrinker_(nullptr)
+	{
+	}
+
+	/**
+	 * Gives memory back to the page allocator.
+	 *
+	 * @return - The number of pages released
+	 */
+	virtual u64 shrink() = 0;
+
+private:
+	shrinker *next_shrinker_;
+};
+} // namespace stacsos::kernel::mem
@@ -7,34 +7,105 @@
  */
 #pragma once
 
-#include <stacsos/bitset.h>
+#include <stacsos/kernel/lock.h>
 
 namespace stacsos::kernel::mem {
+
 enum class slab_state { empty, partial, full };
 
-template <size_t object_size, int slab_page_order> class slab_cache {
+/**
+ * Called on each object when a slab is created or released, for caches that keep
+ * their free objects constructed.
+ */
+using slab_object_hook = void (*)(void *obj);
+
+/**
+ * The page-level parts of a slab cache, which don't depend on the object size.
+ * Slabs are passed around by the address of their first byte.
+ */
+struct slab_pages {
+	static void *allocate(int order);
+	static void release(void *slab_memory, int order);
+	static void tag(void *slab_memory, int order, u32 cache_id);
+	static void *slab_base(void *obj, u32 cache_id);
+};
+
+/**
+ * A snapshot of the counters for one slab cache (and, when it comes from the
+ * object allocator, the magazine layer in front of it).
+ */
+struct slab_cache_stats {
+	size_t object_size;
+	size_t slab_size;
+	u64 objects_per_slab;
+
+	u64 objects_in_use;
+	u64 objects_cached;
+	u64 nr_slabs[3];
+
+	u64 allocations;
+	u64 frees;
+	u64 slabs_allocated;
+	u64 slabs_released;
+
+	u64 magazine_hits;
+	u64 depot_hits;
+	u64 magazine_misses;
+
+	// The total size asked for by the allocations counted above.
+	u64 requested_bytes;
+};
+
+/**
+ * A cache of equally-sized objects, carved out of slabs of one or more pages.  Each
+ * slab keeps its free objects on a list threaded through the objects themselves,
+ * and the cache keeps its slabs on separate lists by state, so that allocation
+ * takes the first object of the first partial (or else empty) slab, and freeing
+ * finds the slab through the page descriptor.
+ *
+ * Up to a limit, empty slabs are kept for reuse, and beyond that they are given
+ * back to the page allocator as soon as they become empty.  The rest can be given
+ * back with shrink().
+ *
+ * The cache doesn't allocate slab pages itself: when every slab is full, the caller
+ * allocates pages with allocate_slab() (without holding any locks that protect the
+ * cache) and adds them with grow().  allocate() does all of this, given the lock.
+ *
+ * Normally the free-list link overwrites the start of a free object.  Caches that
+ * keep their free objects constructed (see the hooks passed to the constructor)
+ * put the link at link_offset instead, past the end of the object proper.
+ */
+template <size_t object_size, int slab_page_order, size_t link_offset = 0> class slab_cache {
 private:
+	static_assert(link_offset + sizeof(void *) <= object_size, "objects must be large enough to hold a free-list link");
+
 	static const size_t slab_memory_size = ((1u << slab_page_order) * PAGE_SIZE);
 	static const size_t slab_object_capacity = slab_memory_size / object_size;
 
 	class slab {
 		friend class slab_cache;
 
-		static const size_t header_size = sizeof(slab);
-		static const size_t reserved_objects = (header_size + (object_size - 1)) / object_size;
+		struct free_object {
+			free_object *next;
+		};
 
-		friend class cache;
+		static free_object *&link_of(void *obj) { return ((free_object *)((uintptr_t)obj + link_offset))->next; }
 
-		using object_index_type = u64;
+		static const size_t header_size = sizeof(slab *) * 2 + sizeof(free_object *) + sizeof(size_t);
+		static const size_t reserved_objects = (header_size + (object_size - 1)) / object_size;
 
 	public:
 		slab()
 			: next_(nullptr)
+			, prev_(nullptr)
+			, free_list_(nullptr)
 			, used_count_(0)
 		{
-			for (u64 i = 0; i < reserved_objects; i++) {
-				used_[i] = true;
-				used_count_++;
+			// Thread the free list through the objects, so that the lowest is handed out first.
+			for (size_t i = slab_object_capacity; i > reserved_objects; i--) {
+				free_object *obj = (free_object *)object_ptr(i - 1);
+				link_of(obj) = free_list_;
+				free_list_ = obj;
 			}
 		}
 
@@ -43,111 +114,277 @@ private:
 			return (used_objects() == 0) ? slab_state::empty : ((used_objects() == capacity()) ? slab_state::full : slab_state::partial);
 		}
 
-		size_t capacity() const { return slab_object_capacity; }
+		static size_t capacity() { return slab_object_capacity - reserved_objects; }
 
 		size_t used_objects() const { return used_count_; }
 
 		void *allocate()
 		{
-			assert(state() != slab_state::full);
-
-			object_index_type free_object = used_.find_first_zero();
+			assert(free_list_);
 
-			if (free_object == ~0ull) {
-				panic("slab is full!");
-			}
-
-			used_[free_object] = true;
+			free_object *obj = free_list_;
+			free_list_ = link_of(obj);
 			used_count_++;
 
-			return object_ptr(free_object);
+			return obj;
 		}
 
 		void free(void *ptr)
 		{
-			u64 used_object = index_of(ptr);
-
-			used_[used_object] = false;
+			free_object *obj = (free_object *)ptr;
+			link_of(obj) = free_list_;
+			free_list_ = obj;
 			used_count_--;
 		}
 
-		bool contains_object(void *ptr) { return ((uintptr_t)ptr >= (uintptr_t)this) && ((uintptr_t)ptr < (uintptr_t)this + slab_memory_size); }
+		bool contains_object(void *ptr)
+		{
+			uintptr_t offset = (uintptr_t)ptr - (uintptr_t)this;
+			return offset >= (reserved_objects * object_size) && offset < (slab_object_capacity * object_size) && !(offset % object_size);
+		}
 
-		void *object_ptr(object_index_type object_index) { return (void *)((uintptr_t)this + (object_index * object_size)); }
+		void *object_ptr(size_t object_index) { return (void *)((uintptr_t)this + (object_index * object_size)); }
 
-		object_index_type index_of(void *object_ptr) { return ((uintptr_t)object_ptr - (uintptr_t)this) / object_size; }
+		void for_each_object(slab_object_hook fn)
+		{
+			for (size_t i = reserved_objects; i < slab_object_capacity; i++) {
+				fn(object_ptr(i));
+			}
+		}
 
 	private:
-		slab *next_;
+		slab *next_, *prev_;
+		free_object *free_list_;
 		size_t used_count_;
-		stacsos::bitset<slab_object_capacity> used_;
 	};
 
+	static_assert(sizeof(slab) == slab::header_size);
+
 public:
-	slab_cache()
-		: slabs_(nullptr)
+	/**
+	 * @param id - A non-zero identifier for this cache, recorded in the descriptor of each slab page
+	 * @param empty_slab_limit - The number of empty slabs to keep, rather than give back
+	 * @param ctor - If given, called on every object when its slab is created
+	 * @param dtor - If given, called on every object when its slab is released
+	 */
+	slab_cache(u32 id, u64 empty_slab_limit = 2, slab_object_hook ctor = nullptr, slab_object_hook dtor = nullptr)
+		: id_(id)
+		, empty_slab_limit_(empty_slab_limit)
+		, ctor_(ctor)
+		, dtor_(dtor)
+		, allocations_(0)
+		, frees_(0)
+		, slabs_allocated_(0)
+		, slabs_released_(0)
 	{
+		for (int i = 0; i < 3; i++) {
+			slabs_[i] = nullptr;
+			nr_slabs_[i] = 0;
+		}
 	}
 
-	void *allocate()
+	/**
+	 * Allocates an object from one of the existing slabs.
+	 *
+	 * @return - The object, or nullptr if every slab is full
+	 */
+	void *try_allocate()
 	{
-		// Find a free slab
-		slab *s = slabs_;
-		while (s && s->state() == slab_state::full) {
-			s = s->next_;
-		}
-
+		slab *s = slabs_[(int)slab_state::partial];
 		if (!s) {
-			// Allocate a new slab
-			void *slab_base = allocate_slab();
-			if (!slab_base) {
-				panic("out of memory");
+			s = slabs_[(int)slab_state::empty];
+			if (!s) {
+				return nullptr;
 			}
-
-			s = new (slab_base) slab();
-			s->next_ = slabs_;
-			slabs_ = s;
 		}
 
+		slab_state before = s->state();
 		void *ptr = s->allocate();
+		update_state(s, before);
+
+		allocations_++;
+
 		// dprintf("malloc: cache-size=%u, slab=%p, ptr=%p\n", object_size, s, ptr);
 		return ptr;
 	}
 
-	bool try_free(void *ptr)
+	/**
+	 * Allocates an object, growing the cache if every slab is full.  The lock that
+	 * protects the cache is dropped while the slab pages are allocated, as the page
+	 * allocator may call back into a shrinker.
+	 *
+	 * @return - The object, or nullptr if no memory is available for a new slab
+	 */
+	void *allocate(spinlock_irq &lock)
 	{
-		// Find containing slab
-		slab *s = slabs_;
-		while (s) {
-			if (s->contains_object(ptr)) {
-				break;
+		while (true) {
+			{
+				unique_irq_lock l(lock);
+
+				void *obj = try_allocate();
+				if (obj) {
+					return obj;
+				}
 			}
 
-			s = s->next_;
+			// Another core may grow the cache first, in which case this just goes
+			// round again.
+			void *slab_memory = allocate_slab();
+			if (!slab_memory) {
+				return nullptr;
+			}
+
+			unique_irq_lock l(lock);
+			grow(slab_memory);
 		}
+	}
 
-		if (!s) {
-			return false;
+	/**
+	 * Allocates the pages for a new slab, for passing to grow().
+	 */
+	static void *allocate_slab() { return slab_pages::allocate(slab_page_order); }
+
+	/**
+	 * Adds a new (empty) slab to the cache.
+	 *
+	 * @param slab_memory - The memory for the slab, from allocate_slab()
+	 */
+	void grow(void *slab_memory)
+	{
+		slab_pages::tag(slab_memory, slab_page_order, id_);
+
+		slab *s = new (slab_memory) slab();
+		if (ctor_) {
+			s->for_each_object(ctor_);
 		}
 
+		link(s);
+		slabs_allocated_++;
+	}
+
+	void free(void *ptr)
+	{
+		slab *s = slab_of(ptr);
+		assert(s->contains_object(ptr));
+
+		slab_state before = s->state();
 		s->free(ptr);
+		update_state(s, before);
+
+		frees_++;
+
 		// dprintf("free: ptr=%p\n", ptr);
 
-		// TODO: Free slabs?
+		if (s->state() == slab_state::empty && nr_slabs_[(int)slab_state::empty] > empty_slab_limit_) {
+			release_slab(s);
+		}
+	}
+
+	/**
+	 * Gives every empty slab back to the page allocator.
+	 *
+	 * @return - The number of pages released
+	 */
+	u64 shrink()
+	{
+		u64 released = 0;
+
+		while (slabs_[(int)slab_state::empty]) {
+			release_slab(slabs_[(int)slab_state::empty]);
+			released += 1u << slab_page_order;
+		}
 
-		return true;
+		return released;
 	}
 
-	void free(void *ptr)
+	void get_stats(slab_cache_stats &stats) const
 	{
-		if (!try_free(ptr)) {
-			panic("object not in cache\n");
+		stats.object_size = object_size;
+		stats.slab_size = slab_memory_size;
+		stats.objects_per_slab = slab::capacity();
+		stats.objects_in_use = allocations_ - frees_;
+		stats.allocations = allocations_;
+		stats.frees = frees_;
+		stats.slabs_allocated = slabs_allocated_;
+		stats.slabs_released = slabs_released_;
+
+		for (int i = 0; i < 3; i++) {
+			stats.nr_slabs[i] = nr_slabs_[i];
 		}
 	}
 
 private:
-	slab *slabs_;
+	u32 id_;
+	u64 empty_slab_limit_;
+	slab_object_hook ctor_, dtor_;
+
+	// Indexed by slab_state.
+	slab *slabs_[3];
+	u64 nr_slabs_[3];
+
+	u64 allocations_, frees_, slabs_allocated_, slabs_released_;
+
+	slab *slab_of(void *ptr) const { return (slab *)slab_pages::slab_base(ptr, id_); }
+
+	/**
+	 * Gives an empty slab's pages back to the page allocator.
+	 */
+	void release_slab(slab *s)
+	{
+		assert(s->state() == slab_state::empty);
+
+		unlink(s, slab_state::empty);
+
+		if (dtor_) {
+			s->for_each_object(dtor_);
+		}
 
-	void *allocate_slab();
+		slab_pages::release(s, slab_page_order);
+		slabs_released_++;
+	}
+
+	void link(slab *s)
+	{
+		int state = (int)s->state();
+
+		s->prev_ = nullptr;
+		s->next_ = slabs_[state];
+
+		if (slabs_[state]) {
+			slabs_[state]->prev_ = s;
+		}
+
+		slabs_[state] = s;
+		nr_slabs_[state]++;
+	}
+
+	void unlink(slab *s, slab_state old_state)
+	{
+		int state = (int)old_state;
+
+		if (s->prev_) {
+			s->prev_->next_ = s->next_;
+		} else {
+			slabs_[state] = s->next_;
+		}
+
+		if (s->next_) {
+			s->next_->prev_ = s->prev_;
+		}
+
+		s->next_ = s->prev_ = nullptr;
+		nr_slabs_[state]--;
+	}
+
+	/**
+	 * Moves a slab to the right list, if an allocation or free has changed its state.
+	 */
+	void update_state(slab *s, slab_state old_state)
+	{
+		if (s->state() != old_state) {
+			unlink(s, old_state);
+			link(s);
+		}
+	}
 };
 } // namespace stacsos::kernel::mem
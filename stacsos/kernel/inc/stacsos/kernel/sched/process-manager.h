@@ -27,6 +27,16 @@ public:
 	shared_ptr<process> create_kernel_process(continuation_fn ep);
 	shared_ptr<process> create_process(const char *path, const char *args);
 
+	/**
+	 * Calls fn(process) for every process, in the order they were created.
+	 */
+	template <class F> void for_each_process(F fn)
+	{
+		for (auto &p : active_processes_) {
+			fn(*p.get());
+		}
+	}
+
 private:
 	list<shared_ptr<process>> active_processes_;
 };
@@ -8,6 +8,7 @@
 #pragma once
 
 #include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/kmem-cache.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/sched/event.h>
 #include <stacsos/kernel/sched/thread.h>
@@ -33,6 +34,8 @@ public:
 	{
 	}
 
+	DECLARE_KMEM_CACHE_OPERATORS()
+
 	exec_privilege privilege() const { return priv_; }
 
 	shared_ptr<thread> create_thread(u64 entry_point, void *entry_arg = nullptr);
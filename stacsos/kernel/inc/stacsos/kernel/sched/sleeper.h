@@ -7,12 +7,15 @@
  */
 #pragma once
 
+#include <stacsos/kernel/mem/kmem-cache.h>
 #include <stacsos/list.h>
 
 namespace stacsos::kernel::sched {
 class thread;
 
 struct sleeping_thread {
+	DECLARE_KMEM_CACHE_OPERATORS()
+
 	thread *thr;
 	u64 wakeup_deadline;
 };
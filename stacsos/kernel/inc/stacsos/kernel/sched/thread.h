@@ -8,6 +8,7 @@
 #pragma once
 
 #include <stacsos/kernel/arch/x86/machine-context.h>
+#include <stacsos/kernel/mem/kmem-cache.h>
 #include <stacsos/kernel/sched/event.h>
 #include <stacsos/kernel/sched/schedulable-entity.h>
 
@@ -33,6 +34,8 @@ public:
 
 	thread(process &owner, u64 ep = 0, void *ep_arg = nullptr, u64 user_stack = 0);
 
+	DECLARE_KMEM_CACHE_OPERATORS()
+
 	thread_states state() const { return state_; }
 	event &state_changed_event() { return state_changed_event_; }
 
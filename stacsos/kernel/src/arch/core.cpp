@@ -32,7 +32,11 @@ core &core::this_core()
 static void idle_thread()
 {
 	while (true) {
-		__relax();
+		// Give the memory manager a chance to do some background work (such as
+		// pre-zeroing pages), and only relax once it has nothing left to do.
+		if (!memory_manager::get().perform_idle_work()) {
+			__relax();
+		}
 	}
 }
 
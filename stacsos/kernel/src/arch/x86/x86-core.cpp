@@ -11,6 +11,7 @@
 #include <stacsos/kernel/arch/x86/x86-core.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/sched/process.h>
 #include <stacsos/kernel/sched/thread.h>
 #include <stacsos/memops.h>
 
@@ -202,17 +203,28 @@ void x86_core::handle_gpf(machine_context *mc)
 
 void x86_core::handle_page_fault(machine_context *mc)
 {
-	if (memory_manager::get().try_handle_page_fault(cr2::read())) {
-		return;
+	// Only user addresses can be backed on demand, and only once there is a thread
+	// (and so an address space) to back them in.  Anything else is reported below.
+	u64 address = cr2::read();
+	if (address < address_space::user_space_end && get_current_tcb()) {
+		// The error code is in the "extra" slot of the saved context.
+		if (memory_manager::get().try_handle_page_fault(thread::current().owner().addrspace(), address, (page_fault_flags)mc->extra)) {
+			return;
+		}
 	}
 
-	thread::current().stop();
-
 	dprintf("CORE %d - UNHANDLED PAGE FAULT\n", id());
 	mc->dump();
 
 	dump_regs();
 
+	// There is no thread to stop if this happened during boot.
+	if (!get_current_tcb()) {
+		panic("Unhandled Page Fault", mc);
+	}
+
+	thread::current().stop();
+
 	// panic("Unhandled Page Fault", mc);
 	schedule();
 }
@@ -18,6 +18,20 @@ static u16 pd_index(u64 address) { return (address >> PAGE_BITS >> 9) & 0x1ff; }
 static u16 pdp_index(u64 address) { return (address >> PAGE_BITS >> 9 >> 9) & 0x1ff; }
 static u16 pml4_index(u64 address) { return (address >> PAGE_BITS >> 9 >> 9 >> 9) & 0x1ff; }
 
+/**
+ * Access is only restricted by the leaf entries, so that one table can hold both
+ * read-only and writable (and user and kernel) mappings.  An entry that leads to
+ * a user mapping must allow user access, though.
+ */
+template <typename T> static void allow_access(T &entry, bool user)
+{
+	entry.rw(true);
+
+	if (user) {
+		entry.us(true);
+	}
+}
+
 x86_page_table *x86_page_table::create_empty(page_table_allocator &pta)
 {
 	page *pml4 = pta.allocate();
@@ -51,10 +65,10 @@ void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 phy
 		page *l3page = pta.allocate();
 		l4.base_address(l3page->base_address());
 		l4.present(true);
-		l4.rw(rw);
-		l4.us(user);
 	}
 
+	allow_access(l4, user);
+
 	pdpe &l3 = (*(pdp *)page::get_from_base_address(l4.base_address()).base_address_ptr())[pdp_index(virtual_address)];
 	if (size == mapping_size::m1g) {
 		if (l3.present() && !l3.size()) {
@@ -78,24 +92,33 @@ void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 phy
 			l3.reset();
 			l3.base_address(l2page->base_address());
 			l3.present(true);
-			l3.rw(rw);
-			l3.us(user);
 		}
+
+		allow_access(l3, user);
 	}
 
 	pde &l2 = (*(pd *)page::get_from_base_address(l3.base_address()).base_address_ptr())[pd_index(virtual_address)];
 	if (size == mapping_size::m2m) {
 		if (l2.present() && !l2.size()) {
-			panic("overlapping mapping");
-		} else {
+			// A page table left behind by earlier (since unmapped) 4K mappings can be
+			// replaced, but not one that still maps anything.
+			page &l1page = page::get_from_base_address(l2.base_address());
+			if (!table_empty(*(pt *)l1page.base_address_ptr())) {
+				panic("overlapping mapping");
+			}
+
 			l2.reset();
-			l2.base_address(physical_address);
-			l2.size(true);
-			l2.present(true);
-			l2.rw(rw);
-			l2.us(user);
-			return;
+			invalidate(virtual_address);
+			pta.free(&l1page);
 		}
+
+		l2.reset();
+		l2.base_address(physical_address);
+		l2.size(true);
+		l2.present(true);
+		l2.rw(rw);
+		l2.us(user);
+		return;
 	} else {
 		if (l2.present()) {
 			if (l2.size()) {
@@ -106,9 +129,9 @@ void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 phy
 			l2.reset();
 			l2.base_address(l1page->base_address());
 			l2.present(true);
-			l2.rw(rw);
-			l2.us(user);
 		}
+
+		allow_access(l2, user);
 	}
 
 	pte &l1 = (*(pt *)page::get_from_base_address(l2.base_address()).base_address_ptr())[pt_index(virtual_address)];
@@ -119,6 +142,150 @@ void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 phy
 	l1.us(user);
 }
 
+template <typename T> bool x86_page_table::table_empty(const T &table)
+{
+	for (int i = 0; i < 0x200; i++) {
+		if (table[i].present()) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Finds the entry that maps a virtual address, at whichever level the mapping is.
+ *
+ * @return - The leaf entry, or nullptr if the address isn't mapped
+ */
+base_entry *x86_page_table::find_leaf(u64 virtual_address, mapping_size &size) const
+{
+	const pml4e &l4 = pml4_[pml4_index(virtual_address)];
+	if (!l4.present()) {
+		return nullptr;
+	}
+
+	pdpe &l3 = (*(pdp *)page::get_from_base_address(l4.base_address()).base_address_ptr())[pdp_index(virtual_address)];
+	if (!l3.present()) {
+		return nullptr;
+	}
+
+	if (l3.size()) {
+		size = mapping_size::m1g;
+		return &l3;
+	}
+
+	pde &l2 = (*(pd *)page::get_from_base_address(l3.base_address()).base_address_ptr())[pd_index(virtual_address)];
+	if (!l2.present()) {
+		return nullptr;
+	}
+
+	if (l2.size()) {
+		size = mapping_size::m2m;
+		return &l2;
+	}
+
+	pte &l1 = (*(pt *)page::get_from_base_address(l2.base_address()).base_address_ptr())[pt_index(virtual_address)];
+	if (!l1.present()) {
+		return nullptr;
+	}
+
+	size = mapping_size::m4k;
+	return &l1;
+}
+
+/**
+ * Removes the mapping that covers a virtual address (which, for a large mapping,
+ * removes the whole of it).  Page tables that become empty are left in place, and
+ * the caller is responsible for invalidating the TLB.
+ */
+void x86_page_table::unmap(page_table_allocator &pta, u64 virtual_address)
+{
+	mapping_size size;
+	base_entry *leaf = find_leaf(virtual_address, size);
+	if (leaf) {
+		leaf->reset();
+	}
+}
+
+bool x86_page_table::reclaim_tables(page_table_allocator &pta, u64 start, u64 end)
+{
+	bool freed = false;
+
+	for (u64 l4_addr = start & ~(GB(512) - 1); l4_addr < end; l4_addr += GB(512)) {
+		// The kernel's tables are shared by every address space.
+		pml4e &l4 = pml4_[pml4_index(l4_addr)];
+		if (pml4_index(l4_addr) >= 0x100 || !l4.present()) {
+			continue;
+		}
+
+		page &l3page = page::get_from_base_address(l4.base_address());
+		pdp &l3_table = *(pdp *)l3page.base_address_ptr();
+
+		for (u64 l3_addr = max(start, l4_addr) & ~(GB(1) - 1); l3_addr < end && l3_addr < l4_addr + GB(512); l3_addr += GB(1)) {
+			pdpe &l3 = l3_table[pdp_index(l3_addr)];
+			if (!l3.present() || l3.size()) {
+				continue;
+			}
+
+			page &l2page = page::get_from_base_address(l3.base_address());
+			pd &l2_table = *(pd *)l2page.base_address_ptr();
+
+			for (u64 l2_addr = max(start, l3_addr) & ~(MB(2) - 1); l2_addr < end && l2_addr < l3_addr + GB(1); l2_addr += MB(2)) {
+				pde &l2 = l2_table[pd_index(l2_addr)];
+				if (!l2.present() || l2.size()) {
+					continue;
+				}
+
+				page &l1page = page::get_from_base_address(l2.base_address());
+				if (table_empty(*(pt *)l1page.base_address_ptr())) {
+					l2.reset();
+					pta.free(&l1page);
+					freed = true;
+				}
+			}
+
+			if (table_empty(l2_table)) {
+				l3.reset();
+				pta.free(&l2page);
+				freed = true;
+			}
+		}
+
+		if (table_empty(l3_table)) {
+			l4.reset();
+			pta.free(&l3page);
+			freed = true;
+		}
+	}
+
+	return freed;
+}
+
+/**
+ * Looks up the physical address that a virtual address is mapped to.
+ *
+ * @param size - If given, receives the size of the mapping that covers the address
+ * @return - true if the address is mapped
+ */
+bool x86_page_table::translate(u64 virtual_address, u64 &physical_address, mapping_size *mapped_size) const
+{
+	mapping_size size;
+	base_entry *leaf = find_leaf(virtual_address, size);
+	if (!leaf) {
+		return false;
+	}
+
+	if (mapped_size) {
+		*mapped_size = size;
+	}
+
+	u64 offset_mask = size == mapping_size::m1g ? GB(1) - 1 : size == mapping_size::m2m ? MB(2) - 1 : PAGE_SIZE - 1;
+	physical_address = (leaf->base_address() & ~offset_mask) + (virtual_address & offset_mask);
+
+	return true;
+}
+
 void x86_page_table::dump() const
 {
 	dprintf("vma @ %p (%p)\n", this, this);
@@ -10,6 +10,9 @@
 #include <stacsos/kernel/arch/x86/pio.h>
 #include <stacsos/kernel/arch/x86/text-console.h>
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/fs/fs-node.h>
+#include <stacsos/kernel/fs/vfs.h>
 #include <stacsos/printf.h>
 
 using namespace stacsos;
@@ -112,3 +115,95 @@ void debug_helper::parse_image()
 		}
 	}*/
 }
+
+const char *debug_helper::lookup_symbol(u64 addr, u64 &offset)
+{
+	if (!symbols_loaded_) {
+		load_symbols();
+	}
+
+	for (u64 i = 0; i < nr_symbols_; i++) {
+		const kernel_symbol &sym = symbols_[i];
+
+		if (addr >= sym.address && addr < sym.address + sym.size) {
+			offset = addr - sym.address;
+			return &symbol_names_[sym.name];
+		}
+	}
+
+	return nullptr;
+}
+
+/**
+ * Reads the function symbols (and the string table that holds their names) out of
+ * the kernel ELF on the root filesystem.  If the file isn't there, or isn't what it
+ * should be, there are simply no symbols.
+ */
+void debug_helper::load_symbols()
+{
+	symbols_loaded_ = true;
+
+	auto *node = fs::vfs::get().lookup("/boot/stacsos.sym");
+	if (!node) {
+		dprintf("debug: kernel symbols not found\n");
+		return;
+	}
+
+	auto file = node->open();
+	if (!file) {
+		return;
+	}
+
+	elf_header<64> ehdr;
+	if (file->pread(&ehdr, 0, sizeof(ehdr)) != sizeof(ehdr) || ehdr.e_ident.ei_class != elf_ident_classes::ei_class_64bit
+		|| ehdr.e_shentsize != sizeof(elf_sectionheader<64>)) {
+		dprintf("debug: invalid kernel symbol file\n");
+		return;
+	}
+
+	auto *section_headers = new elf_sectionheader<64>[ehdr.e_shnum];
+	file->pread(section_headers, ehdr.e_shoff, ehdr.e_shnum * sizeof(elf_sectionheader<64>));
+
+	for (u16 shidx = 0; shidx < ehdr.e_shnum; shidx++) {
+		const elf_sectionheader<64> &symtab = section_headers[shidx];
+		if (symtab.sh_type != SHT_SYMTAB || symtab.sh_link >= ehdr.e_shnum) {
+			continue;
+		}
+
+		const elf_sectionheader<64> &strtab = section_headers[symtab.sh_link];
+
+		u64 nr_elf_symbols = symtab.sh_size / sizeof(elf_sym<64>);
+		auto *elf_symbols = new elf_sym<64>[nr_elf_symbols];
+		file->pread(elf_symbols, symtab.sh_offset, nr_elf_symbols * sizeof(elf_sym<64>));
+
+		symbol_names_ = new char[strtab.sh_size + 1];
+		file->pread(symbol_names_, strtab.sh_offset, strtab.sh_size);
+		symbol_names_[strtab.sh_size] = 0;
+
+		// Only functions are of interest, so count them before keeping them.
+		const u8 stt_func = 2;
+		for (u64 i = 0; i < nr_elf_symbols; i++) {
+			if ((elf_symbols[i].st_info & 0xf) == stt_func && elf_symbols[i].st_name < strtab.sh_size) {
+				nr_symbols_++;
+			}
+		}
+
+		symbols_ = new kernel_symbol[nr_symbols_];
+
+		u64 next = 0;
+		for (u64 i = 0; i < nr_elf_symbols; i++) {
+			const elf_sym<64> &sym = elf_symbols[i];
+
+			if ((sym.st_info & 0xf) == stt_func && sym.st_name < strtab.sh_size) {
+				symbols_[next++] = { sym.st_value, sym.st_size, sym.st_name };
+			}
+		}
+
+		delete[] elf_symbols;
+		break;
+	}
+
+	delete[] section_headers;
+
+	dprintf("debug: loaded %lu kernel symbols\n", nr_symbols_);
+}
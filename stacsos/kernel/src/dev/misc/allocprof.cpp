@@ -0,0 +1,123 @@
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/misc/allocprof.h>
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/mem/alloc-profiler.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/memops.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+using namespace stacsos::kernel::mem;
+
+device_class allocprof::allocprof_device_class(device_class::root, "allocprof");
+
+/*
+ * Implements file operations for the allocprof device when opened by userspace.  The
+ * text is regenerated into a fixed-size buffer whenever a read starts at offset zero.
+ */
+class allocprof_file : public file {
+public:
+	static const size_t capacity = 0x4000;
+	static const u64 max_reported_sites = 64;
+
+	allocprof_file()
+		: file(capacity)
+		, length_(0)
+	{
+	}
+
+	virtual size_t pread(void *buffer, size_t offset, size_t length) override
+	{
+		if (offset == 0) {
+			snapshot();
+		}
+
+		if (offset >= length_) {
+			return 0;
+		}
+
+		size_t amount = min(length, length_ - offset);
+		memops::memcpy(buffer, &text_[offset], amount);
+
+		return amount;
+	}
+
+	// No writing allowed!
+	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) override { return 0; }
+
+private:
+	char text_[capacity];
+	size_t length_;
+
+	void append(const char *fmt, ...)
+	{
+		va_list args;
+		va_start(args, fmt);
+		length_ += vsnprintf(&text_[length_], capacity - length_, fmt, args);
+		va_end(args);
+	}
+
+	void snapshot()
+	{
+		length_ = 0;
+
+		alloc_profiler *profiler = memory_manager::get().profiler();
+		if (!profiler) {
+			append("allocation profiling is disabled (boot with allocprof=yes)\n");
+			return;
+		}
+
+		auto *sites = new alloc_site_stats[alloc_profiler::nr_sites];
+		u64 nr_sites = profiler->snapshot(sites, alloc_profiler::nr_sites);
+
+		u64 tsc_frequency = x86_core::this_core().local_tsc().frequency();
+		u64 elapsed = __builtin_ia32_rdtsc() - profiler->start_time();
+		u64 elapsed_ms = tsc_frequency ? elapsed / (tsc_frequency / 1000) : 0;
+
+		append("sites:      %lu (%lu not recorded)\n", nr_sites, profiler->dropped_sites());
+		append("untracked:  %lu allocations\n", profiler->untracked_allocations());
+		append("elapsed:    %lu ms\n", elapsed_ms);
+		append("kind    live-bytes  allocations    frees  rate/s   size  class  caller\n");
+
+		// Report the sites with the most live memory, by repeatedly moving the largest
+		// remaining one to the front.
+		u64 nr_reported = min(nr_sites, max_reported_sites);
+		for (u64 i = 0; i < nr_reported; i++) {
+			u64 largest = i;
+			for (u64 j = i + 1; j < nr_sites; j++) {
+				if (sites[j].live_bytes > sites[largest].live_bytes) {
+					largest = j;
+				}
+			}
+
+			swap(sites[i], sites[largest]);
+			report_site(sites[i], elapsed_ms);
+		}
+
+		delete[] sites;
+	}
+
+	void report_site(const alloc_site_stats &site, u64 elapsed_ms)
+	{
+		u64 rate = elapsed_ms ? (site.allocations * 1000) / elapsed_ms : 0;
+
+		append("%6s  %10lu  %11lu  %7lu  %6lu  %5u  %5d  %p", site.kind == alloc_kind::pages ? "pages" : "object", site.live_bytes, site.allocations,
+			site.frees, rate, site.last_size, site.size_class, site.caller);
+
+		u64 offset;
+		const char *name = debug_helper::get().lookup_symbol((u64)site.caller, offset);
+		if (name) {
+			append(" %s+0x%lx", name, offset);
+		}
+
+		append("\n");
+	}
+};
+
+shared_ptr<file> allocprof::open_as_file() { return shared_ptr(new allocprof_file()); }
@@ -0,0 +1,146 @@
+#include <stacsos/kernel/dev/misc/meminfo.h>
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/mem/kmem-cache.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/object-allocator.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/memops.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::sched;
+
+device_class meminfo::meminfo_device_class(device_class::root, "meminfo");
+
+/*
+ * Implements file operations for the meminfo device when opened by userspace.  The
+ * text is regenerated into a fixed-size buffer whenever a read starts at offset zero.
+ */
+class meminfo_file : public file {
+public:
+	static const size_t capacity = 0x2000;
+
+	meminfo_file()
+		: file(capacity)
+		, length_(0)
+	{
+	}
+
+	virtual size_t pread(void *buffer, size_t offset, size_t length) override
+	{
+		if (offset == 0) {
+			snapshot();
+		}
+
+		if (offset >= length_) {
+			return 0;
+		}
+
+		size_t amount = min(length, length_ - offset);
+		memops::memcpy(buffer, &text_[offset], amount);
+
+		return amount;
+	}
+
+	// No writing allowed!
+	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) override { return 0; }
+
+private:
+	char text_[capacity];
+	size_t length_;
+
+	void append(const char *fmt, ...)
+	{
+		va_list args;
+		va_start(args, fmt);
+		length_ += vsnprintf(&text_[length_], capacity - length_, fmt, args);
+		va_end(args);
+	}
+
+	void snapshot()
+	{
+		page_allocator_stats stats;
+		memory_manager::get().pgalloc().get_stats(stats);
+
+		length_ = 0;
+
+		append("total:       %lu pages\n", stats.total_pages);
+		append("free:        %lu pages\n", stats.free_pages);
+		append("allocated:   %lu pages\n", stats.total_pages - stats.free_pages);
+		append("cached:      %lu pages\n", stats.cached_pages);
+		append("allocations: %lu\n", stats.allocations);
+		append("frees:       %lu\n", stats.frees);
+		append("failures:    %lu\n", stats.failures);
+		append("splits:      %lu\n", stats.splits);
+		append("merges:      %lu\n", stats.merges);
+		append("fallbacks:   %lu\n", stats.fallbacks);
+		append("order  free-blocks  frag-index\n");
+
+		for (int order = 0; order < page_allocator_stats::nr_orders; order++) {
+			int index = stats.fragmentation_index(order);
+
+			if (index < 0) {
+				append("%5u  %11lu  %10s\n", order, stats.free_blocks[order], "-");
+			} else {
+				append("%5u  %11lu  %4u.%03u\n", order, stats.free_blocks[order], index / 1000, index % 1000);
+			}
+		}
+
+		append("size  in-use  cached  partial  full  empty  released  allocations  mag-hit%%  depot%%  frag%%  slab-waste%%\n");
+
+		for (int size_class = 0; size_class < object_allocator::nr_size_classes; size_class++) {
+			slab_cache_stats slab_stats;
+			memory_manager::get().objalloc().get_stats(size_class, slab_stats);
+
+			u64 requests = slab_stats.magazine_hits + slab_stats.depot_hits + slab_stats.magazine_misses;
+			u64 hit_rate = requests ? (slab_stats.magazine_hits * 100) / requests : 0;
+			u64 depot_rate = requests ? (slab_stats.depot_hits * 100) / requests : 0;
+
+			// Internal fragmentation is the part of each slot not asked for, and slab
+			// waste is the part of each slab (the header and the tail) not in a slot.
+			u64 slot_bytes = requests * slab_stats.object_size;
+			u64 frag = slot_bytes ? ((slot_bytes - slab_stats.requested_bytes) * 100) / slot_bytes : 0;
+			u64 slab_waste = ((slab_stats.slab_size - slab_stats.objects_per_slab * slab_stats.object_size) * 100) / slab_stats.slab_size;
+
+			append("%4lu  %6lu  %6lu  %7lu  %4lu  %5lu  %8lu  %11lu  %8lu  %6lu  %5lu  %11lu\n", slab_stats.object_size, slab_stats.objects_in_use,
+				slab_stats.objects_cached, slab_stats.nr_slabs[(int)slab_state::partial], slab_stats.nr_slabs[(int)slab_state::full],
+				slab_stats.nr_slabs[(int)slab_state::empty], slab_stats.slabs_released, slab_stats.allocations, hit_rate, depot_rate, frag, slab_waste);
+		}
+
+		append("               cache  size  per-slab  in-use  slabs  allocations\n");
+
+		for (kmem_cache_base *cache = kmem_cache_base::first(); cache; cache = cache->next()) {
+			slab_cache_stats cache_stats;
+			cache->get_stats(cache_stats);
+
+			u64 nr_slabs = cache_stats.nr_slabs[0] + cache_stats.nr_slabs[1] + cache_stats.nr_slabs[2];
+
+			append("%20s  %4lu  %8lu  %6lu  %5lu  %11lu\n", cache->name(), cache_stats.object_size, cache_stats.objects_per_slab,
+				cache_stats.objects_in_use, nr_slabs, cache_stats.allocations);
+		}
+
+		// Committed pages are covered by a region, and resident pages are actually
+		// backed, so the difference is what on-demand paging has saved.
+		append("process       state  regions  committed  resident  resident%%\n");
+
+		u64 index = 0;
+		process_manager::get().for_each_process([&](process &p) {
+			static const char *state_names[] = { "created", "started", "terminated" };
+
+			address_space_stats as_stats;
+			p.addrspace().get_stats(as_stats);
+
+			u64 resident_rate = as_stats.committed_pages ? (as_stats.resident_pages * 100) / as_stats.committed_pages : 0;
+
+			append("%7lu  %10s  %7lu  %9lu  %8lu  %9lu\n", index++, state_names[(int)p.state()], as_stats.nr_regions, as_stats.committed_pages,
+				as_stats.resident_pages, resident_rate);
+		});
+	}
+};
+
+shared_ptr<file> meminfo::open_as_file() { return shared_ptr(new meminfo_file()); }
@@ -13,6 +13,8 @@
 using namespace stacsos;
 using namespace stacsos::kernel::fs;
 
+DEFINE_KMEM_CACHE_OPERATORS(tarfs_node, "tarfs-node")
+
 fs_node *tarfs_node::resolve_child(const string &name)
 {
 	// dprintf("tarfs: resolve child %s\n", name.c_str());
@@ -15,7 +15,9 @@
 #include <stacsos/kernel/dev/device-manager.h>
 #include <stacsos/kernel/dev/gfx/qemu-stdvga.h>
 #include <stacsos/kernel/dev/input/keyboard.h>
+#include <stacsos/kernel/dev/misc/allocprof.h>
 #include <stacsos/kernel/dev/misc/cmos-rtc.h>
+#include <stacsos/kernel/dev/misc/meminfo.h>
 #include <stacsos/kernel/dev/storage/ahci-storage-device.h>
 #include <stacsos/kernel/dev/tty/terminal.h>
 #include <stacsos/kernel/fs/filesystem.h>
@@ -45,6 +47,14 @@ static void init_console()
 	auto rtc = new cmos_rtc(dm.sysbus());
 	dm.register_device(*rtc);
 
+	auto mi = new meminfo(dm.sysbus());
+	dm.register_device(*mi);
+	dm.add_device_alias(*mi, "meminfo");
+
+	auto ap = new allocprof(dm.sysbus());
+	dm.register_device(*ap);
+	dm.add_device_alias(*ap, "allocprof");
+
 	auto kbd = new keyboard(dm.sysbus());
 	dm.register_device(*kbd);
 
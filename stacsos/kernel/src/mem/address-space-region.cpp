@@ -6,3 +6,7 @@
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
 #include <stacsos/kernel/mem/address-space-region.h>
+
+using namespace stacsos::kernel::mem;
+
+DEFINE_KMEM_CACHE_OPERATORS(address_space_region, "address-space-region")
@@ -8,58 +8,640 @@
 #include <stacsos/kernel/mem/address-space-region.h>
 #include <stacsos/kernel/mem/address-space.h>
 #include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
 #include <stacsos/kernel/mem/page-table-allocator.h>
 #include <stacsos/kernel/mem/page-table.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/memops.h>
 
+using namespace stacsos::kernel;
 using namespace stacsos::kernel::mem;
 
+// Protects the reference counts of pages shared copy-on-write, which may be changed
+// from any of the address spaces sharing them.
+static spinlock_irq shared_pages_lock;
+
 address_space *address_space::create_linked(u64 alloc_rgn_start)
 {
 	auto linked_pt = pt_->create_linked_copy(pta_);
 	return new address_space(pta_, linked_pt, alloc_rgn_start);
 }
 
-address_space_region *address_space::alloc_region(u64 size, region_flags flags, bool allocate)
+address_space *address_space::clone()
+{
+	auto *as = memory_manager::get().root_address_space().create_linked(alloc_rgn_start_);
+
+	unique_irq_lock l(lock_);
+
+	regions_.for_each([&](u64 base, address_space_region *rgn) {
+		auto copy = new address_space_region(*rgn);
+		as->committed_pages_ += rgn->size >> PAGE_BITS;
+
+		mapping_flags shared_flags = mapping_flags_of(*rgn) & ~mapping_flags::writable;
+
+		for (u64 addr = rgn->base; addr < rgn->base + rgn->size; addr += PAGE_SIZE) {
+			u64 phys;
+			if (!pt_->translate(addr, phys)) {
+				continue;
+			}
+
+			{
+				unique_irq_lock sl(shared_pages_lock);
+				page::get_from_base_address(phys).acquire();
+			}
+
+			pt_->map(pta_, addr, phys, shared_flags);
+			page_table::invalidate(addr);
+
+			as->pt_->map(pta_, addr, phys, shared_flags);
+			as->resident_pages_++;
+		}
+
+		as->regions_.add(base, copy);
+	});
+
+	return as;
+}
+
+u64 address_space::alloc_region(u64 size, region_flags flags, bool allocate)
 {
 	u64 aligned_size = PAGE_ALIGN_UP(size);
-	u64 base = next_alloc_rgn_;
-	next_alloc_rgn_ += aligned_size;
+	if (!aligned_size) {
+		return 0;
+	}
 
-	return add_region(base, size, flags, allocate);
+	unique_irq_lock l(lock_);
+
+	u64 base = find_gap(aligned_size);
+	if (!base || !insert_region(base, aligned_size, flags, allocate)) {
+		return 0;
+	}
+
+	return base;
 }
 
 address_space_region *address_space::add_region(u64 base, u64 size, region_flags flags, bool allocate)
 {
+	//dprintf("as: add-region base=%lx size=%lx flags=%d alloc=%d\n", base, size, flags, allocate);
+
+	u64 aligned_size = PAGE_ALIGN_UP(size);
+	if (!aligned_size) {
+		return nullptr;
+	}
+
+	unique_irq_lock l(lock_);
+
+	if (overlaps_region(base, aligned_size)) {
+		return nullptr;
+	}
+
+	return insert_region(base, aligned_size, flags, allocate);
+}
+
+/**
+ * Adds a region over a free range, merging it with regions with the same
+ * permissions that end where it starts, or start where it ends.
+ */
+address_space_region *address_space::insert_region(u64 base, u64 size, region_flags flags, bool allocate)
+{
+	if (allocate && !populate_range(base, size, flags)) {
+		return nullptr;
+	}
+
+	committed_pages_ += size >> PAGE_BITS;
+
+	u64 prev_base;
+	address_space_region *prev;
+	if (regions_.try_get_floor(base, prev_base, prev) && prev->base + prev->size == base && prev->flags == flags) {
+		prev->size += size;
+		merge_next(*prev);
+		return prev;
+	}
+
 	auto rgn = new address_space_region();
 	rgn->base = base;
 	rgn->size = size;
 	rgn->flags = flags;
 
-	//dprintf("as: add-region base=%lx size=%lx flags=%d alloc=%d\n", base, size, flags, allocate);
+	merge_next(*rgn);
+	regions_.add(base, rgn);
+
+	return rgn;
+}
+
+/**
+ * Absorbs the region directly after a region into it, if it has the same
+ * permissions.
+ */
+void address_space::merge_next(address_space_region &rgn)
+{
+	u64 next_base;
+	address_space_region *next;
+	if (!regions_.try_get_ceiling(rgn.base + rgn.size, next_base, next) || next_base != rgn.base + rgn.size || next->flags != rgn.flags) {
+		return;
+	}
+
+	regions_.remove(next_base);
+	rgn.size += next->size;
+
+	delete next;
+}
+
+/**
+ * Backs a range with exactly as many (zeroed) pages as it covers, rather than the
+ * next power of two.  For each set bit in the number of pages, a block of that order
+ * is allocated, largest first, and the blocks are mapped one after another, e.g. 13
+ * pages = 1101 = order 3 (8) + order 2 (4) + order 0 (1).  When a block of some
+ * order isn't available, two of the next order down are used instead.
+ *
+ * @return - false if there wasn't enough memory, in which case nothing is mapped
+ */
+bool address_space::populate_range(u64 base, u64 size, region_flags flags)
+{
+	u64 page_count = size >> PAGE_BITS;
+
+	u64 mapped = 0;
+	for (int order = 63; order >= 0; order--) {
+		if (!(page_count & (1ull << order))) {
+			continue;
+		}
+
+		if (!populate_block(base + (mapped << PAGE_BITS), order, mapping_flags_of(flags), mapped)) {
+			unmap_range(base, base + (mapped << PAGE_BITS));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Backs 2^order pages, starting at the given address, with one block of that order
+ * if possible, or else with two blocks of the next order down (and so on, down to
+ * single pages).
+ *
+ * @param mapped - Incremented by the number of pages mapped
+ * @return - false if there wasn't enough memory
+ */
+bool address_space::populate_block(u64 address, int order, mapping_flags flags, u64 &mapped)
+{
+	page *block = memory_manager::get().pgalloc().allocate_pages(order, page_allocation_flags::zero | page_allocation_flags::movable);
+	if (block) {
+		u64 nr_pages = 1ull << order;
+
+		for (u64 i = 0; i < nr_pages; i++) {
+			//dprintf("map virt=%p phys=%p\n", address + (i << PAGE_BITS), block->base_address() + (i << PAGE_BITS));
+			pt_->map(pta_, address + (i << PAGE_BITS), block->base_address() + (i << PAGE_BITS), flags, mapping_size::m4k);
+		}
+
+		mapped += nr_pages;
+		resident_pages_ += nr_pages;
+		return true;
+	}
+
+	if (order == 0) {
+		return false;
+	}
+
+	return populate_block(address, order - 1, flags, mapped) && populate_block(address + (PAGE_SIZE << (order - 1)), order - 1, flags, mapped);
+}
+
+bool address_space::overlaps_region(u64 base, u64 size) const
+{
+	if (base + size < base) {
+		return true;
+	}
+
+	// The only region that can overlap is the last one starting before the end of
+	// the range.
+	u64 rgn_base;
+	address_space_region *rgn;
+	return regions_.try_get_floor(base + size - 1, rgn_base, rgn) && rgn_base + rgn->size > base;
+}
+
+/**
+ * Finds the lowest free range of the given size, at or above the allocation start,
+ * by stepping from each region to the next until the space before one is large
+ * enough.
+ *
+ * @return - The base of the range, or zero if the user part of the address space
+ * is full
+ */
+u64 address_space::find_gap(u64 size) const
+{
+	u64 candidate = alloc_rgn_start_;
+
+	u64 rgn_base;
+	address_space_region *rgn;
+	if (regions_.try_get_floor(candidate, rgn_base, rgn) && rgn_base + rgn->size > candidate) {
+		candidate = rgn_base + rgn->size;
+	}
+
+	while (regions_.try_get_ceiling(candidate, rgn_base, rgn) && rgn_base - candidate < size) {
+		candidate = rgn_base + rgn->size;
+	}
+
+	if (candidate + size < candidate || candidate + size > user_space_end) {
+		return 0;
+	}
+
+	return candidate;
+}
+
+void address_space::get_stats(address_space_stats &stats) const
+{
+	unique_irq_lock l(lock_);
+
+	stats.nr_regions = 0;
+	regions_.for_each([&](u64, address_space_region *) { stats.nr_regions++; });
+
+	stats.committed_pages = committed_pages_;
+	stats.resident_pages = resident_pages_;
+}
+
+/**
+ * Removes a range of addresses from the regions covering it, shrinking or splitting
+ * any region that is only partly covered, and gives back the pages mapped in it.
+ */
+bool address_space::remove_region(u64 base, u64 size)
+{
+	u64 end = base + PAGE_ALIGN_UP(size);
+	if ((base & ~PAGE_MASK) || end <= base || end > user_space_end) {
+		return false;
+	}
+
+	unique_irq_lock l(lock_);
+
+	bool removed = false;
+
+	// A region that starts before the range may run into it, or right through it.
+	u64 rgn_base;
+	address_space_region *rgn;
+	if (regions_.try_get_floor(base, rgn_base, rgn) && rgn_base < base && rgn_base + rgn->size > base) {
+		u64 rgn_end = rgn_base + rgn->size;
+		rgn->size = base - rgn_base;
+
+		if (rgn_end > end) {
+			auto tail = new address_space_region();
+			tail->base = end;
+			tail->size = rgn_end - end;
+			tail->flags = rgn->flags;
+
+			regions_.add(end, tail);
+		}
+
+		committed_pages_ -= (min(rgn_end, end) - base) >> PAGE_BITS;
+		removed = true;
+	}
+
+	while (regions_.try_get_ceiling(base, rgn_base, rgn) && rgn_base < end) {
+		u64 rgn_end = rgn_base + rgn->size;
+		regions_.remove(rgn_base);
+
+		removed = true;
+
+		if (rgn_end > end) {
+			committed_pages_ -= (end - rgn_base) >> PAGE_BITS;
+
+			rgn->base = end;
+			rgn->size = rgn_end - end;
+			regions_.add(end, rgn);
+			break;
+		}
+
+		committed_pages_ -= rgn->size >> PAGE_BITS;
+		delete rgn;
+	}
+
+	if (removed) {
+		unmap_range(base, end);
+	}
+
+	return removed;
+}
+
+/**
+ * Unmaps every page in a range, and gives back the ones that aren't shared with
+ * another address space, along with any page tables left empty.  The TLB is only
+ * invalidated once the page tables have been updated: page by page for a few pages,
+ * or else by flushing it entirely, which is cheaper than a long run of invlpg.
+ */
+void address_space::unmap_range(u64 start, u64 end)
+{
+	static const u64 max_invalidations = 32;
+
+	u64 invalidations[max_invalidations];
+	u64 nr_unmapped = 0;
+
+	for (u64 address = start; address < end; address += PAGE_SIZE) {
+		u64 phys;
+		if (!pt_->translate(address, phys)) {
+			continue;
+		}
+
+		pt_->unmap(pta_, address);
+
+		if (nr_unmapped < max_invalidations) {
+			invalidations[nr_unmapped] = address;
+		}
 
-	if (allocate) {
-		u64 pages = (size + (PAGE_SIZE - 1)) / PAGE_SIZE;
-		rgn->storage = memory_manager::get().pgalloc().allocate_pages(log2_ceil(pages), page_allocation_flags::zero);
+		nr_unmapped++;
 
-		u64 cur_virt = base;
-		u64 cur_phys = rgn->storage->base_address();
+		page &pg = page::get_from_base_address(phys);
 
-		for (u64 i = 0; i < pages; i++) {
-			//dprintf("map virt=%p phys=%p\n", cur_virt, cur_phys);
-			pt_->map(pta_, cur_virt, cur_phys, mapping_flags::present | mapping_flags::writable | mapping_flags::user_accessable, mapping_size::m4k);
-			cur_virt += PAGE_SIZE;
-			cur_phys += PAGE_SIZE;
+		bool exclusive;
+		{
+			unique_irq_lock l(shared_pages_lock);
+			exclusive = pg.release();
 		}
+
+		// The pages of a block go back one by one, and the page allocator merges
+		// them back together.
+		if (exclusive) {
+			memory_manager::get().pgalloc().free_pages(pg, 0);
+		}
+	}
+
+	resident_pages_ -= nr_unmapped;
+
+	bool tables_freed = pt_->reclaim_tables(pta_, start, end);
+
+	if (nr_unmapped > max_invalidations || (tables_freed && !nr_unmapped)) {
+		page_table::flush_tlb();
 	} else {
-		rgn->storage = nullptr;
+		for (u64 i = 0; i < nr_unmapped; i++) {
+			page_table::invalidate(invalidations[i]);
+		}
 	}
+}
 
-	regions_.append(rgn);
+bool address_space::handle_fault(u64 address, page_fault_flags flags)
+{
+	unique_irq_lock l(lock_);
 
-	return rgn;
+	address_space_region *rgn = find_region(address);
+	if (!rgn) {
+		return false;
+	}
+
+	bool write = (flags & page_fault_flags::write) == page_fault_flags::write;
+	if (write && (rgn->flags & region_flags::writable) != region_flags::writable) {
+		return false;
+	}
+
+	// A write to a page that is present in a writable region is a write to a page
+	// that is shared copy-on-write.  Any other fault on a present page is a genuine
+	// protection fault.
+	if ((flags & page_fault_flags::present) == page_fault_flags::present) {
+		return write && unshare_page(*rgn, address) != nullptr;
+	}
+
+	return map_zeroed_page(*rgn, address) != nullptr;
+}
+
+page *address_space::populate_page(u64 address)
+{
+	unique_irq_lock l(lock_);
+
+	address_space_region *rgn = find_region(address);
+	if (!rgn) {
+		return nullptr;
+	}
+
+	// The kernel is going to write to the page, so it mustn't be shared.
+	u64 phys;
+	if (pt_->translate(address & PAGE_MASK, phys)) {
+		return unshare_page(*rgn, address);
+	}
+
+	return map_zeroed_page(*rgn, address);
+}
+
+/**
+ * Backs one page of an on-demand region with a newly allocated, zeroed, page.
+ */
+page *address_space::map_zeroed_page(address_space_region &rgn, u64 address)
+{
+	page *pg = memory_manager::get().pgalloc().allocate_pages(0, page_allocation_flags::zero | page_allocation_flags::movable);
+	if (!pg) {
+		return nullptr;
+	}
+
+	pt_->map(pta_, address & PAGE_MASK, pg->base_address(), mapping_flags_of(rgn), mapping_size::m4k);
+	resident_pages_++;
+
+	return pg;
+}
+
+/**
+ * Makes a mapped page private to this address space, and maps it with the region's
+ * permissions.  If the page is shared copy-on-write, this address space gets its
+ * own copy of it, unless it is the last sharer, in which case it just keeps it.
+ */
+page *address_space::unshare_page(address_space_region &rgn, u64 address)
+{
+	u64 page_address = address & PAGE_MASK;
+
+	u64 phys;
+	if (!pt_->translate(page_address, phys)) {
+		return nullptr;
+	}
+
+	page *pg = &page::get_from_base_address(phys);
+
+	// The copy is made without holding the lock, as allocating it may take a while.
+	// That's safe, as nobody can write to the page while it's shared, but another
+	// sharer may give it up in the meantime, in which case the copy isn't needed.
+	page *copy = nullptr;
+	if (pg->refcount()) {
+		copy = memory_manager::get().pgalloc().allocate_pages(0, page_allocation_flags::movable);
+		if (!copy) {
+			return nullptr;
+		}
+
+		memops::memcpy(copy->base_address_ptr(), pg->base_address_ptr(), PAGE_SIZE);
+	}
+
+	bool use_copy = false;
+	if (copy) {
+		unique_irq_lock l(shared_pages_lock);
+
+		if (pg->refcount()) {
+			pg->release();
+			use_copy = true;
+		}
+	}
+
+	if (use_copy) {
+		pg = copy;
+	} else if (copy) {
+		memory_manager::get().pgalloc().free_pages(*copy, 0);
+	}
+
+	pt_->map(pta_, page_address, pg->base_address(), mapping_flags_of(rgn));
+	page_table::invalidate(page_address);
+
+	return pg;
 }
 
-void address_space::remove_region(u64 base, u64 size, region_flags flags)
+mapping_flags address_space::mapping_flags_of(region_flags rgn_flags)
 {
-	//
+	mapping_flags flags = mapping_flags::present | mapping_flags::user_accessable;
+
+	if ((rgn_flags & region_flags::writable) == region_flags::writable) {
+		flags |= mapping_flags::writable;
+	}
+
+	return flags;
+}
+
+/**
+ * @return - The first word of the page mapped at an address, read through the
+ * direct map, or zero if nothing is mapped there
+ */
+static u64 read_mapped_word(const address_space &as, u64 address, u64 *phys_out = nullptr)
+{
+	u64 phys;
+	if (!as.pgtable().translate(address, phys)) {
+		panic("address-space self-test: page not mapped");
+	}
+
+	if (phys_out) {
+		*phys_out = phys;
+	}
+
+	return *(u64 *)page::get_from_base_address(phys).base_address_ptr();
+}
+
+static void write_mapped_word(const address_space &as, u64 address, u64 value)
+{
+	u64 phys;
+	if (!as.pgtable().translate(address, phys)) {
+		panic("address-space self-test: page not mapped");
+	}
+
+	*(u64 *)page::get_from_base_address(phys).base_address_ptr() = value;
+}
+
+static u64 page_frees()
+{
+	page_allocator_stats stats;
+	memory_manager::get().pgalloc().get_stats(stats);
+
+	return stats.frees;
+}
+
+/**
+ * Checks copy-on-write cloning: that a clone sees its parent's data, that a write on
+ * either side gets that side its own copy, and that removing a shared page from one
+ * side leaves the other side's alone, until the last sharer removes it too.  Writes
+ * are simulated by calling the fault handler, and pages are read and written through
+ * the direct map, so the address spaces never have to be active.
+ *
+ * Address spaces can't be freed, so the two made here are leaked (but not the pages
+ * mapped in them).
+ */
+void address_space::perform_selftest()
+{
+	dprintf("*** ADDRESS SPACE SELF TEST ***\n");
+
+	const page_fault_flags write_fault = page_fault_flags::present | page_fault_flags::write | page_fault_flags::user;
+
+	address_space *parent = memory_manager::get().root_address_space().create_linked(0x7fff'2000'0000);
+
+	// Pages 0-2 are backed and filled in; page 3 is left untouched.
+	u64 base = parent->alloc_region(PAGE_SIZE * 4, region_flags::readwrite, false);
+	if (!base) {
+		panic("address-space self-test: unable to allocate region");
+	}
+
+	for (u64 i = 0; i < 3; i++) {
+		page *pg = parent->populate_page(base + (i * PAGE_SIZE));
+		if (!pg) {
+			panic("address-space self-test: unable to populate page");
+		}
+
+		*(u64 *)pg->base_address_ptr() = 0x1000 + i;
+	}
+
+	dprintf("(1) Clone sees the parent's data\n");
+	address_space *child = parent->clone();
+
+	for (u64 i = 0; i < 3; i++) {
+		u64 parent_phys, child_phys;
+		if (read_mapped_word(*child, base + (i * PAGE_SIZE), &child_phys) != 0x1000 + i) {
+			panic("address-space self-test: clone has the wrong data");
+		}
+
+		read_mapped_word(*parent, base + (i * PAGE_SIZE), &parent_phys);
+		if (parent_phys != child_phys || page::get_from_base_address(parent_phys).refcount() != 1) {
+			panic("address-space self-test: page not shared");
+		}
+	}
+
+	u64 phys;
+	if (child->pgtable().translate(base + (3 * PAGE_SIZE), phys)) {
+		panic("address-space self-test: untouched page was mapped in the clone");
+	}
+
+	dprintf("(2) Write in the parent copies the page\n");
+	u64 original0, copy0;
+	read_mapped_word(*child, base, &original0);
+
+	if (!parent->handle_fault(base, write_fault)) {
+		panic("address-space self-test: write fault not handled");
+	}
+
+	write_mapped_word(*parent, base, 0x2000);
+	if (read_mapped_word(*parent, base, &copy0) != 0x2000 || copy0 == original0 || read_mapped_word(*child, base) != 0x1000) {
+		panic("address-space self-test: parent write not private");
+	}
+
+	// The child is now the only user of the original, so keeps it.
+	if (!child->handle_fault(base, write_fault) || read_mapped_word(*child, base, &phys) != 0x1000 || phys != original0) {
+		panic("address-space self-test: last sharer didn't keep the page");
+	}
+
+	dprintf("(3) Write in the clone copies the page\n");
+	u64 original1, copy1;
+	read_mapped_word(*parent, base + PAGE_SIZE, &original1);
+
+	if (!child->handle_fault(base + PAGE_SIZE, write_fault)) {
+		panic("address-space self-test: write fault not handled");
+	}
+
+	write_mapped_word(*child, base + PAGE_SIZE, 0x3000);
+	if (read_mapped_word(*child, base + PAGE_SIZE, &copy1) != 0x3000 || copy1 == original1 || read_mapped_word(*parent, base + PAGE_SIZE) != 0x1001) {
+		panic("address-space self-test: clone write not private");
+	}
+
+	dprintf("(4) Removing a shared page from one side keeps it for the other\n");
+	u64 shared2;
+	read_mapped_word(*parent, base + (2 * PAGE_SIZE), &shared2);
+
+	// The pages either side stay mapped, so no page tables are freed, and the
+	// regions are split rather than freed.
+	u64 frees_before = page_frees();
+
+	if (!child->remove_region(base + (2 * PAGE_SIZE), PAGE_SIZE)) {
+		panic("address-space self-test: region not removed");
+	}
+
+	if (child->pgtable().translate(base + (2 * PAGE_SIZE), phys) || page_frees() != frees_before) {
+		panic("address-space self-test: shared page not unmapped, or freed");
+	}
+
+	if (read_mapped_word(*parent, base + (2 * PAGE_SIZE), &phys) != 0x1002 || phys != shared2 || page::get_from_base_address(shared2).refcount() != 0) {
+		panic("address-space self-test: other side lost the shared page");
+	}
+
+	dprintf("(5) Removing it from the last sharer frees it\n");
+	if (!parent->remove_region(base + (2 * PAGE_SIZE), PAGE_SIZE) || page_frees() != frees_before + 1) {
+		panic("address-space self-test: page not freed by the last sharer");
+	}
+
+	parent->remove_region(base, PAGE_SIZE * 4);
+	child->remove_region(base, PAGE_SIZE * 4);
+
+	dprintf("*** ADDRESS SPACE SELF TEST PASSED ***\n");
 }
@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/alloc-profiler.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page.h>
+
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::mem;
+
+alloc_profiler *alloc_profiler::create(memory_manager &mm)
+{
+	u64 nr_pages = (sizeof(alloc_profiler) + PAGE_SIZE - 1) >> PAGE_BITS;
+
+	page *pg = mm.pgalloc().allocate_page_run(nr_pages, page_allocation_flags::zero);
+	if (!pg) {
+		panic("unable to allocate memory for the allocation profiler");
+	}
+
+	return new (pg->base_address_ptr()) alloc_profiler();
+}
+
+/**
+ * The tables are in zeroed memory, so an unused entry is one with a null key.
+ */
+alloc_profiler::alloc_profiler()
+	: start_time_(__builtin_ia32_rdtsc())
+	, dropped_sites_(0)
+	, untracked_allocations_(0)
+{
+}
+
+void alloc_profiler::record_alloc(alloc_kind kind, void *caller, const void *ptr, u64 size, int size_class)
+{
+	if (!ptr) {
+		return;
+	}
+
+	unique_irq_lock l(lock_);
+
+	alloc_site_stats *site = find_site(caller, kind);
+	if (!site) {
+		dropped_sites_++;
+		return;
+	}
+
+	site->allocations++;
+	site->total_bytes += size;
+	site->last_size = size;
+	site->size_class = size_class;
+
+	// Only allocations that can be matched up with their free count as live.
+	if (track(ptr, site - sites_, size)) {
+		site->live_bytes += size;
+	} else {
+		untracked_allocations_++;
+	}
+}
+
+void alloc_profiler::record_free(const void *ptr)
+{
+	if (!ptr) {
+		return;
+	}
+
+	unique_irq_lock l(lock_);
+
+	// Allocations from before profiling started (or that weren't tracked) aren't
+	// counted.
+	u32 site;
+	u64 size;
+	if (untrack(ptr, site, size)) {
+		sites_[site].frees++;
+		sites_[site].live_bytes -= size;
+	}
+}
+
+u64 alloc_profiler::snapshot(alloc_site_stats *sites, u64 max_sites) const
+{
+	unique_irq_lock l(lock_);
+
+	u64 count = 0;
+	for (u64 i = 0; i < nr_sites && count < max_sites; i++) {
+		if (sites_[i].caller) {
+			sites[count++] = sites_[i];
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Finds the entry for a call site, or makes one.
+ *
+ * @return - The site, or nullptr if the table is full
+ */
+alloc_site_stats *alloc_profiler::find_site(void *caller, alloc_kind kind)
+{
+	u64 slot = hash(caller) % nr_sites;
+
+	for (u64 probes = 0; probes < nr_sites; probes++) {
+		alloc_site_stats &site = sites_[slot];
+
+		if (!site.caller) {
+			site.caller = caller;
+			site.kind = kind;
+			return &site;
+		}
+
+		if (site.caller == caller && site.kind == kind) {
+			return &site;
+		}
+
+		slot = (slot + 1) % nr_sites;
+	}
+
+	return nullptr;
+}
+
+bool alloc_profiler::track(const void *ptr, u32 site, u64 size)
+{
+	u64 slot = hash(ptr) % nr_tracked_allocations;
+
+	for (u64 probes = 0; probes < nr_tracked_allocations; probes++) {
+		tracked_allocation &a = allocations_[slot];
+
+		if (!a.ptr) {
+			a.ptr = ptr;
+			a.site = site;
+			a.size = size > 0xffff'ffff ? 0xffff'ffff : size;
+			return true;
+		}
+
+		slot = (slot + 1) % nr_tracked_allocations;
+	}
+
+	return false;
+}
+
+/**
+ * Removes an allocation from the table.  The table uses linear probing, so the
+ * entries after the removed one are shifted back to close the gap, rather than
+ * leaving a tombstone.
+ */
+bool alloc_profiler::untrack(const void *ptr, u32 &site, u64 &size)
+{
+	u64 slot = hash(ptr) % nr_tracked_allocations;
+
+	for (u64 probes = 0; probes < nr_tracked_allocations; probes++) {
+		tracked_allocation &a = allocations_[slot];
+
+		if (!a.ptr) {
+			return false;
+		}
+
+		if (a.ptr == ptr) {
+			site = a.site;
+			size = a.size;
+			break;
+		}
+
+		slot = (slot + 1) % nr_tracked_allocations;
+	}
+
+	if (allocations_[slot].ptr != ptr) {
+		return false;
+	}
+
+	u64 hole = slot;
+	u64 next = (slot + 1) % nr_tracked_allocations;
+
+	while (allocations_[next].ptr) {
+		// An entry can move back into the hole if its home slot isn't between the
+		// hole and where it is now (cyclically).
+		u64 home = hash(allocations_[next].ptr) % nr_tracked_allocations;
+		bool movable = hole <= next ? (home <= hole || home > next) : (home <= hole && home > next);
+
+		if (movable) {
+			allocations_[hole] = allocations_[next];
+			hole = next;
+		}
+
+		next = (next + 1) % nr_tracked_allocations;
+	}
+
+	allocations_[hole].ptr = nullptr;
+	return true;
+}
@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/kmem-cache.h>
+#include <stacsos/node-storage.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::mem;
+
+kmem_cache_base *kmem_cache_base::caches_;
+kmem_cache_base *kmem_cache_base::by_id_[max_caches];
+u32 kmem_cache_base::nr_caches_;
+
+/**
+ * Caches are created by static constructors, before there is more than one core, so
+ * the list needs no lock.
+ */
+kmem_cache_base::kmem_cache_base(const char *name)
+	: name_(name)
+	, next_(caches_)
+{
+	if (nr_caches_ == max_caches) {
+		panic("too many kmem caches");
+	}
+
+	id_ = first_cache_id + nr_caches_;
+	by_id_[nr_caches_++] = this;
+	caches_ = this;
+}
+
+kmem_cache_base *kmem_cache_base::find(u32 cache_id)
+{
+	if (cache_id < first_cache_id || cache_id >= first_cache_id + nr_caches_) {
+		return nullptr;
+	}
+
+	return by_id_[cache_id - first_cache_id];
+}
+
+namespace {
+class kmem_cache_shrinker : public shrinker {
+public:
+	virtual u64 shrink() override
+	{
+		u64 released = 0;
+
+		for (kmem_cache_base *c = kmem_cache_base::first(); c; c = c->next()) {
+			released += c->shrink();
+		}
+
+		return released;
+	}
+};
+
+kmem_cache_shrinker shrinker_instance;
+} // namespace
+
+shrinker &kmem_cache_base::all_caches_shrinker() { return shrinker_instance; }
+
+/*
+ * Storage for the nodes of library containers (see stacsos/node-storage.h).  These
+ * are small and short-lived, so each size (in multiples of eight bytes, up to 64)
+ * gets its own cache of exactly that size, rather than going through the
+ * power-of-two size classes of the object allocator.
+ */
+template <size_t size> struct node_storage {
+	alignas(8) u8 bytes[size];
+};
+
+static kmem_cache<node_storage<8>, 8> node_cache8("node-8");
+static kmem_cache<node_storage<16>, 8> node_cache16("node-16");
+static kmem_cache<node_storage<24>, 8> node_cache24("node-24");
+static kmem_cache<node_storage<32>, 8> node_cache32("node-32");
+static kmem_cache<node_storage<40>, 8> node_cache40("node-40");
+static kmem_cache<node_storage<48>, 8> node_cache48("node-48");
+static kmem_cache<node_storage<56>, 8> node_cache56("node-56");
+static kmem_cache<node_storage<64>, 8> node_cache64("node-64");
+
+static kmem_cache_base *const node_caches[] = {
+	&node_cache8,
+	&node_cache16,
+	&node_cache24,
+	&node_cache32,
+	&node_cache40,
+	&node_cache48,
+	&node_cache56,
+	&node_cache64,
+};
+
+void *stacsos::allocate_node_storage(size_t size)
+{
+	if (!size || size > 64) {
+		return ::operator new(size);
+	}
+
+	return node_caches[(size - 1) / 8]->alloc_object();
+}
+
+void stacsos::free_node_storage(void *ptr, size_t size)
+{
+	if (!size || size > 64) {
+		::operator delete(ptr);
+		return;
+	}
+
+	if (ptr) {
+		node_caches[(size - 1) / 8]->free_object(ptr);
+	}
+}
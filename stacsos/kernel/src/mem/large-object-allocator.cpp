@@ -5,6 +5,7 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/large-object-allocator.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/object-allocator.h>
@@ -23,69 +24,303 @@ using namespace stacsos::kernel::mem;
  */
 void *large_object_allocator::allocate(size_t size)
 {
-	auto &pga = memory_manager::get().pgalloc();
-	auto &pta = memory_manager::get().ptalloc();
-
-	// This is technically locked by the "object allocator" spin lock.
+	// This is locked by the object allocator's large object lock.
 
 	u64 nr_pages = (size + PAGE_SIZE - 1) >> PAGE_BITS;
-	u64 target = (u64)base_;
+	if (!nr_pages) {
+		return nullptr;
+	}
 
-	page_table &v = memory_manager::get().root_address_space().pgtable();
+	u64 index;
+	if (!take_range(nr_pages, nr_pages >= huge_page_pages ? huge_page_pages : 1, index)) {
+		return nullptr;
+	}
+
+	if (!populate_range(index, nr_pages)) {
+		release_range(index, nr_pages);
+		return nullptr;
+	}
+
+	allocations_.add(index, nr_pages);
+
+	return (void *)address_of(index);
+}
+
+size_t large_object_allocator::size_of(void *p)
+{
+	u64 nr_pages;
+	if (!ptr_in_region(p) || !allocations_.try_get_value(index_of(p), nr_pages)) {
+		return 0;
+	}
+
+	return nr_pages << PAGE_BITS;
+}
+
+/**
+ * Grows an allocation into the virtual range directly after it, which must either be
+ * (the start of) a large enough free range, or the unused part of the region.
+ */
+bool large_object_allocator::grow(void *p, size_t size)
+{
+	u64 index = index_of(p);
+
+	u64 nr_pages;
+	if (!ptr_in_region(p) || !allocations_.try_get_value(index, nr_pages)) {
+		return false;
+	}
+
+	u64 new_nr_pages = (size + PAGE_SIZE - 1) >> PAGE_BITS;
+	if (new_nr_pages <= nr_pages) {
+		return true;
+	}
+
+	u64 end = index + nr_pages;
+	u64 extra = new_nr_pages - nr_pages;
+
+	u64 free_pages;
+	if (free_by_address_.try_get_value(end, free_pages)) {
+		if (free_pages < extra) {
+			return false;
+		}
+
+		remove_free_range(end, free_pages);
+
+		if (free_pages > extra) {
+			add_free_range(end + extra, free_pages - extra);
+		}
+	} else if (address_of(end) == (u64)base_ && end + extra <= (size_ >> PAGE_BITS)) {
+		base_ = (void *)address_of(end + extra);
+	} else {
+		return false;
+	}
+
+	if (!populate_range(end, extra)) {
+		release_range(end, extra);
+		return false;
+	}
+
+	allocations_.remove(index);
+	allocations_.add(index, new_nr_pages);
+
+	return true;
+}
 
-	// We've computed the maximum number of pages needed to hold the allocation,
-	// so for each bit in the number of pages required, allocate that order.
-	// This works because, e.g. 3 pages = 0011 = order 1 (2) + order 0 (1)
-	// And, e.g. 13 pages = 1101 = order 3 (8) + order 2 (4) + order 0 (1)
-
-	// What we're doing is allocating physical pages for each order, then
-	// "glueing" them together in the large object address space by inserting
-	// appropriate mappings into the page table.
-
-	// TODO: not sure how "free" is going to work... maybe some kind of
-	// balanced tree holding the allocations?  Also, what if a page
-	// allocation fails halfway through!?
-
-	int pgi = 0; // The current monotonic page counter
-	for (int i = 0; i < 32; i++) {
-		// Only allocate when the bit is set
-		if (nr_pages & (1 << i)) {
-			page *pg = pga.allocate_pages(i); // Allocate a block of pages
-
-			if (!pg) {
-				panic("unable to allocate pages for object");
-			}
-
-			// For each page in the block...
-			for (int j = 0; j < (1 << i); j++) {
-				// Map the pages in this block into the virtual address space.
-				v.map(pta, target + (PAGE_SIZE * pgi), pg->base_address() + (PAGE_SIZE * j), mapping_flags::writable);
-
-				// Increase the current page counter.
-				pgi++;
-			}
+/**
+ * Backs a range of the region with physical pages.  For each bit in the number of
+ * pages, a block of that order is allocated, largest first.  This works because,
+ * e.g. 13 pages = 1101 = order 3 (8) + order 2 (4) + order 0 (1).  The blocks are
+ * then "glued" together in the large object region by mapping them one after
+ * another.
+ *
+ * @return - false if there wasn't enough memory, in which case nothing is mapped
+ */
+bool large_object_allocator::populate_range(u64 index, u64 page_count)
+{
+	u64 mapped = 0;
+	for (int order = 63; order >= 0; order--) {
+		if (!(page_count & (1ull << order))) {
+			continue;
 		}
+
+		if (!populate(index + mapped, order, mapped)) {
+			// Give back what has been mapped so far.
+			unmap_pages(index, mapped);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Backs 2^order pages of the region, starting at the given page, with one block of
+ * that order if possible, or else with two blocks of the next order down (and so
+ * on, down to single pages).
+ *
+ * @param mapped - Incremented by the number of pages mapped
+ * @return - false if there wasn't enough memory
+ */
+bool large_object_allocator::populate(u64 index, int order, u64 &mapped)
+{
+	page *block = memory_manager::get().pgalloc().allocate_pages(order);
+	if (block) {
+		map_block(index, *block, order);
+		mapped += 1ull << order;
+		return true;
+	}
+
+	if (order == 0) {
+		return false;
 	}
 
-	// HMM: vma_.activate();
+	return populate(index, order - 1, mapped) && populate(index + (1ull << (order - 1)), order - 1, mapped);
+}
+
+/**
+ * Maps a block of pages into the region, with 2 MiB pages if both the block and its
+ * place in the region are suitably aligned.
+ */
+void large_object_allocator::map_block(u64 index, page &block, int order)
+{
+	auto &pta = memory_manager::get().ptalloc();
+	page_table &v = memory_manager::get().root_address_space().pgtable();
+
+	u64 phys = block.base_address();
+	u64 nr_pages = 1ull << order;
 
-	// Advance the base pointer by the number of pages we've just allocated (and mapped)
-	base_ = (void *)((uintptr_t)base_ + (nr_pages * PAGE_SIZE));
-	return (void *)target;
+	if (order >= huge_page_order && !(index & (huge_page_pages - 1)) && !(phys & (MB(2) - 1))) {
+		for (u64 i = 0; i < nr_pages; i += huge_page_pages) {
+			v.map(pta, address_of(index + i), phys + (i << PAGE_BITS), mapping_flags::writable, mapping_size::m2m);
+		}
+	} else {
+		for (u64 i = 0; i < nr_pages; i++) {
+			v.map(pta, address_of(index + i), phys + (i << PAGE_BITS), mapping_flags::writable);
+		}
+	}
 }
 
 /**
  * @brief Frees a block of memory allocated with the corresponding allocate function.
  *
  * @param p A pointer to the block of memory (allocated by allocated), which is to be freed.
+ * @return true if the block was freed, or false if p isn't the start of an allocation.
  */
 bool large_object_allocator::free(void *p)
 {
-	if (!ptr_in_region(p)) {
+	if (!ptr_in_region(p) || ((uintptr_t)p & (PAGE_SIZE - 1))) {
+		return false;
+	}
+
+	u64 index = index_of(p);
+
+	u64 nr_pages;
+	if (!allocations_.try_get_value(index, nr_pages)) {
+		return false;
+	}
+
+	allocations_.remove(index);
+
+	unmap_pages(index, nr_pages);
+	release_range(index, nr_pages);
+
+	return true;
+}
+
+/**
+ * Unmaps pages in the region, invalidating their TLB entries, and gives the physical
+ * pages back to the page allocator.  A 2 MiB mapping goes back as one block, and the
+ * rest page by page (the page allocator merges the pages of a block back together).
+ * Only the local TLB is invalidated: only core 0 runs scheduled threads, so the
+ * other cores shouldn't have these addresses cached.  There is no cross-core
+ * shootdown, so this is a known limitation once they do.
+ */
+void large_object_allocator::unmap_pages(u64 index, u64 page_count)
+{
+	auto &pga = memory_manager::get().pgalloc();
+	auto &pta = memory_manager::get().ptalloc();
+	page_table &v = memory_manager::get().root_address_space().pgtable();
+
+	for (u64 i = 0; i < page_count;) {
+		u64 address = address_of(index + i);
+
+		u64 phys;
+		mapping_size size;
+		if (!v.translate(address, phys, &size)) {
+			panic("large object page not mapped");
+		}
+
+		v.unmap(pta, address);
+		page_table::invalidate(address);
+
+		if (size == mapping_size::m2m) {
+			pga.free_pages(page::get_from_base_address(phys), huge_page_order);
+			i += huge_page_pages;
+		} else {
+			pga.free_pages(page::get_from_base_address(phys), 0);
+			i++;
+		}
+	}
+}
+
+/**
+ * Finds room for an allocation, starting on a multiple of the given alignment (in
+ * pages, a power of two): the smallest free range that is certainly large enough,
+ * or else fresh space above base_.  Any space skipped for alignment is kept free.
+ */
+bool large_object_allocator::take_range(u64 page_count, u64 alignment, u64 &index)
+{
+	u64 key, unused;
+	if (free_by_size_.try_get_ceiling(size_key(0, page_count + alignment - 1), key, unused)) {
+		u64 range_start = key & 0xffff'ffff;
+		u64 range_end = range_start + (key >> 32);
+
+		remove_free_range(range_start, range_end - range_start);
+
+		index = (range_start + alignment - 1) & ~(alignment - 1);
+
+		if (index > range_start) {
+			add_free_range(range_start, index - range_start);
+		}
+
+		if (index + page_count < range_end) {
+			add_free_range(index + page_count, range_end - (index + page_count));
+		}
+
+		return true;
+	}
+
+	u64 top = index_of(base_);
+	index = (top + alignment - 1) & ~(alignment - 1);
+
+	if (index + page_count > (size_ >> PAGE_BITS)) {
 		return false;
 	}
 
-	// TODO
+	if (index > top) {
+		release_range(top, index - top);
+	}
+
+	base_ = (void *)address_of(index + page_count);
 
 	return true;
 }
+
+/**
+ * Returns a virtual range, merging it with the free ranges on either side.  If it
+ * then reaches base_, it is given back to the unused part of the region instead.
+ */
+void large_object_allocator::release_range(u64 index, u64 page_count)
+{
+	u64 start = index;
+	u64 end = index + page_count;
+
+	u64 prev_index, prev_size;
+	if (free_by_address_.try_get_floor(index, prev_index, prev_size) && prev_index + prev_size == start) {
+		remove_free_range(prev_index, prev_size);
+		start = prev_index;
+	}
+
+	u64 next_index, next_size;
+	if (free_by_address_.try_get_ceiling(end, next_index, next_size) && next_index == end) {
+		remove_free_range(next_index, next_size);
+		end = next_index + next_size;
+	}
+
+	if (address_of(end) == (u64)base_) {
+		base_ = (void *)address_of(start);
+	} else {
+		add_free_range(start, end - start);
+	}
+}
+
+void large_object_allocator::add_free_range(u64 index, u64 page_count)
+{
+	free_by_address_.add(index, page_count);
+	free_by_size_.add(size_key(index, page_count), 0);
+}
+
+void large_object_allocator::remove_free_range(u64 index, u64 page_count)
+{
+	free_by_address_.remove(index);
+	free_by_size_.remove(size_key(index, page_count));
+}
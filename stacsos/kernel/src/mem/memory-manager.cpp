@@ -7,9 +7,14 @@
  */
 #include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/alloc-profiler.h>
+#include <stacsos/kernel/mem/kmem-cache.h>
 #include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator-bitmap.h>
 #include <stacsos/kernel/mem/page-allocator-buddy.h>
 #include <stacsos/kernel/mem/page-allocator-linear.h>
+#include <stacsos/kernel/mem/page-allocator-percore.h>
+#include <stacsos/kernel/mem/page-allocator-profiling.h>
 #include <stacsos/kernel/mem/page.h>
 
 extern "C" const char *_IMAGE_START;
@@ -26,45 +31,112 @@ struct memory_block {
 static memory_block memory_blocks[16];
 static int nr_memory_blocks;
 
-static char page_allocator_structure[0x1000];
+static u64 dynamic_data_end;
+
+// Big enough for whichever page allocator backend is chosen at boot.
+static constexpr size_t max_size(size_t a, size_t b) { return a > b ? a : b; }
+static const size_t page_allocator_structure_size
+	= max_size(sizeof(page_allocator_buddy), max_size(sizeof(page_allocator_linear), sizeof(page_allocator_bitmap)));
+
+static char page_allocator_structure[page_allocator_structure_size] __aligned(16);
+static char percore_page_allocator_structure[sizeof(page_allocator_percore)] __aligned(16);
+static char profiling_page_allocator_structure[sizeof(page_allocator_profiling)] __aligned(16);
 
 void memory_manager::init()
 {
 	dprintf("mem: init\n");
 
+	dprintf("memory:\n");
+	u64 last_addr = 0;
+	for (int i = 0; i < nr_memory_blocks; i++) {
+		const memory_block *mb = &memory_blocks[i];
+		dprintf("  %016lx -- %016lx (%S) %%c\n", memory_blocks[i].start, memory_blocks[i].start + memory_blocks[i].length, memory_blocks[i].length,
+			mb->avail ? 'A' : 'X');
+
+		u64 block_last_addr = mb->start + mb->length - 1;
+		if (block_last_addr > last_addr) {
+			last_addr = block_last_addr;
+		}
+	}
+
+	u64 nr_page_descriptors = (last_addr + 1) >> PAGE_BITS;
+	if (nr_page_descriptors > page::max_nr_pages) {
+		dprintf("mem: only the first %lu pages can be used\n", page::max_nr_pages);
+		nr_page_descriptors = page::max_nr_pages;
+	}
+
+	nr_page_descriptors_ = nr_page_descriptors;
+
+	// Indicate to the user how many page descriptors have been detected, and how much
+	// memory the compact descriptor layout saves over the original 32-byte one (type,
+	// state, free-list link, block size and reference count).
+	const u64 original_page_descriptor_size = 32;
+	dprintf("%lu pages (%lu Mb), %lu-byte page descriptors (%lu Kb saved)\n", nr_page_descriptors, (nr_page_descriptors << PAGE_BITS) / 1048576,
+		sizeof(page), ((original_page_descriptor_size - sizeof(page)) * nr_page_descriptors) / 1024);
+
+	// Anything else that has to be allocated before the page allocator is available is
+	// placed after the page descriptors array.
+	dynamic_data_end = (u64)page::get_pagearray() + (sizeof(page) * nr_page_descriptors);
+
 	const char *pgalloc_algorithm_name = config::get().get_option_or_default("pgalloc", "linear");
 	dprintf("\e\x04mem: *** using the '%s' page allocator\e\x07\n", pgalloc_algorithm_name);
 
+	static_assert(alignof(page_allocator_buddy) <= 16 && alignof(page_allocator_linear) <= 16 && alignof(page_allocator_bitmap) <= 16);
+
 	void *page_allocator_object = (void *)page_allocator_structure;
 	if (memops::strcmp(pgalloc_algorithm_name, "buddy") == 0) {
 		pgalloc_ = new (page_allocator_object) page_allocator_buddy(*this);
 	} else if (memops::strcmp(pgalloc_algorithm_name, "linear") == 0) {
 		pgalloc_ = new (page_allocator_object) page_allocator_linear(*this);
+	} else if (memops::strcmp(pgalloc_algorithm_name, "bitmap") == 0) {
+		void *bitmap = allocate_dynamic_data(page_allocator_bitmap::metadata_size(nr_page_descriptors));
+		pgalloc_ = new (page_allocator_object) page_allocator_bitmap(*this, bitmap, nr_page_descriptors);
 	} else {
 		panic("Invalid page allocator algoritm: %s", pgalloc_algorithm_name);
 	}
 
-	dprintf("memory:\n");
-	u64 last_addr = 0;
-	for (int i = 0; i < nr_memory_blocks; i++) {
-		const memory_block *mb = &memory_blocks[i];
-		dprintf("  %016lx -- %016lx (%S) %%c\n", memory_blocks[i].start, memory_blocks[i].start + memory_blocks[i].length, memory_blocks[i].length,
-			mb->avail ? 'A' : 'X');
+	bool use_percore = memops::strcmp(config::get().get_option_or_default("pgalloc-percore", "yes"), "yes") == 0;
 
-		u64 block_last_addr = mb->start + mb->length - 1;
-		if (block_last_addr > last_addr) {
-			last_addr = block_last_addr;
-		}
+	// Only the first section (or enough sections to cover everything allocated so far)
+	// of page descriptors is initialised now.  The rest are initialised later, either in
+	// the background or when the page allocator runs out of memory, which relies on
+	// the per-core page allocator to ask for them.
+	u64 nr_initial_pfns = nr_page_descriptors;
+	if (use_percore && memops::strcmp(config::get().get_option_or_default("pgalloc-deferred-init", "yes"), "yes") == 0) {
+		u64 dynamic_data_end_pfn = PAGE_ALIGN_UP(dynamic_data_end - 0xffff'ffff'8000'0000) >> PAGE_BITS;
+		u64 initial_sections = (dynamic_data_end_pfn + (deferred_section_pages - 1)) / deferred_section_pages;
+
+		nr_initial_pfns = min(nr_page_descriptors, initial_sections * deferred_section_pages);
+	}
+
+	next_deferred_pfn_ = nr_initial_pfns;
+
+	// Time how long it takes to initialise the page descriptors and populate the page
+	// allocator, as this would otherwise grow with the amount of memory in the machine.
+	// The TSC hasn't been calibrated yet, so this can only be reported in cycles.
+	u64 pgalloc_init_start = __builtin_ia32_rdtsc();
+	initialise_page_descriptors(0, nr_initial_pfns);
+	initialise_page_allocator(nr_initial_pfns);
+	pgalloc_init_cycles_ = __builtin_ia32_rdtsc() - pgalloc_init_start;
+
+	dprintf("mem: page allocator initialised in %lu cycles (%lu pages deferred)\n", pgalloc_init_cycles_, nr_page_descriptors - nr_initial_pfns);
+
+	// Put the per-core page caches in front of the page allocator, unless asked not to.
+	if (use_percore) {
+		percore_pgalloc_ = new ((void *)percore_page_allocator_structure) page_allocator_percore(*this, *pgalloc_);
+		pgalloc_ = percore_pgalloc_;
 	}
 
-	u64 nr_page_descriptors = (last_addr + 1) >> PAGE_BITS;
-	initialise_page_descriptors(nr_page_descriptors);
-	initialise_page_allocator(nr_page_descriptors);
 	initialise_object_allocator();
+	initialise_profiler();
 
 	dprintf("switching to primary page table mapping...\n");
 	activate_primary_mapping();
 
+	if (memops::strcmp(config::get().get_option_or_default("vm-selftest", "no"), "yes") == 0) {
+		address_space::perform_selftest();
+	}
+
 	dprintf("done\n");
 }
 
@@ -76,39 +148,59 @@ void memory_manager::add_memory_block(u64 start, u64 length, bool avail)
 	nr_memory_blocks++;
 }
 
-void memory_manager::initialise_page_descriptors(u64 nr_page_descriptors)
+/**
+ * Initialises the page descriptors for a range of PFNs, marking any pages that lie
+ * in unavailable memory blocks as reserved.
+ */
+void memory_manager::initialise_page_descriptors(u64 start_pfn, u64 end_pfn)
 {
-	// Indicate to the user how many page descriptors have been detected.
-	dprintf("%lu pages (%lu Mb)\n", nr_page_descriptors, (nr_page_descriptors << PAGE_BITS) / 1048576);
+	memops::bzero(&page::get_from_pfn(start_pfn), sizeof(page) * (end_pfn - start_pfn));
 
-	// Initialise all page descriptors to zero.
-	memops::bzero(page::get_pagearray(), sizeof(page) * nr_page_descriptors);
-}
+	for (int i = 0; i < nr_memory_blocks; i++) {
+		const memory_block *mb = &memory_blocks[i];
+		if (mb->avail) {
+			continue;
+		}
 
-void memory_manager::initialise_page_allocator(u64 nr_page_descriptors)
-{
-	if (memops::strcmp(config::get().get_option_or_default("pgalloc-selftest", "no"), "yes") == 0) {
-		pgalloc_->perform_selftest();
-		__unreachable();
+		u64 block_start_pfn = max(start_pfn, mb->start >> PAGE_BITS);
+		u64 block_end_pfn = min(end_pfn, (mb->start + mb->length) >> PAGE_BITS);
+
+		for (u64 pfn = block_start_pfn; pfn < block_end_pfn; pfn++) {
+			page::get_from_pfn(pfn).type_ = page_type::reserved;
+		}
 	}
+}
 
-	// Loop through each memory block that we received from the
-	// startup code.
+/**
+ * Inserts the pages from every available memory block that lie within a range of
+ * PFNs into the page allocator.
+ */
+void memory_manager::populate_page_allocator(u64 start_pfn, u64 end_pfn)
+{
 	for (int i = 0; i < nr_memory_blocks; i++) {
 		const memory_block *mb = &memory_blocks[i];
+		if (!mb->avail) {
+			continue;
+		}
 
-		// If the memory block is available, then insert them into the page allocator.
-		if (mb->avail) {
-			// Add these pages to the page allocator
-			pgalloc_->insert_pages(page::get_from_pfn(mb->start >> PAGE_BITS), mb->length >> PAGE_BITS);
-		} else {
-			// Otherwise, mark these pages as reserved.
-			for (u64 pfn = (mb->start >> PAGE_BITS); pfn < ((mb->start + mb->length) >> PAGE_BITS); pfn++) {
-				auto &pg = page::get_from_pfn(pfn);
-				pg.type_ = page_type::reserved;
-			}
+		u64 block_start_pfn = max(start_pfn, mb->start >> PAGE_BITS);
+		u64 block_end_pfn = min(end_pfn, (mb->start + mb->length) >> PAGE_BITS);
+
+		if (block_start_pfn < block_end_pfn) {
+			pgalloc_->insert_pages(page::get_from_pfn(block_start_pfn), block_end_pfn - block_start_pfn);
 		}
 	}
+}
+
+void memory_manager::initialise_page_allocator(u64 nr_initial_pfns)
+{
+	if (memops::strcmp(config::get().get_option_or_default("pgalloc-selftest", "no"), "yes") == 0) {
+		pgalloc_->perform_selftest();
+		__unreachable();
+	}
+
+	// Add the available memory that has page descriptors so far to the page allocator.
+	populate_page_allocator(0, nr_initial_pfns);
 
 	// Now we've added all of the "available" memory regions, we need to take out areas
 	// that we know are already allocated, e.g. the kernel image.
@@ -127,25 +219,86 @@ void memory_manager::initialise_page_allocator(u64 nr_page_descriptors)
 	u64 image_size = ((u64)&_IMAGE_END) - ((u64)&_IMAGE_START);
 	pgalloc_->remove_pages(page::get_from_base_address((u64)&_IMAGE_START), PAGE_ALIGN_UP(image_size) >> PAGE_BITS);
 
-	// Remove the page descriptors array
-	u64 page_descriptors_size = sizeof(page) * nr_page_descriptors;
-	pgalloc_->remove_pages(page::get_from_base_address((u64)&_DYNAMIC_DATA_START - 0xffff'ffff'8000'0000), PAGE_ALIGN_UP(page_descriptors_size) >> PAGE_BITS);
+	// Remove the page descriptors array, and anything allocated after it.
+	u64 dynamic_data_size = dynamic_data_end - (u64)&_DYNAMIC_DATA_START;
+	pgalloc_->remove_pages(page::get_from_base_address((u64)&_DYNAMIC_DATA_START - 0xffff'ffff'8000'0000), PAGE_ALIGN_UP(dynamic_data_size) >> PAGE_BITS);
+}
+
+/**
+ * Allocates memory for data structures that are needed before the page allocator
+ * is up and running.  This memory is never freed.
+ */
+void *memory_manager::allocate_dynamic_data(u64 size)
+{
+	u64 start = (dynamic_data_end + 63) & ~63ull;
+	dynamic_data_end = start + size;
+
+	return (void *)start;
 }
 
 void memory_manager::initialise_object_allocator()
 {
-	// Nothing to do to initialise the object allocator!
+	register_shrinker(objalloc_);
+	register_shrinker(kmem_cache_base::all_caches_shrinker());
+}
+
+/**
+ * Starts profiling allocations, if asked to.  Only allocations made from here on
+ * are counted.  The page allocator is wrapped in one that reports to the profiler,
+ * so that nothing extra is done on the page allocation path when profiling is off.
+ */
+void memory_manager::initialise_profiler()
+{
+	if (memops::strcmp(config::get().get_option_or_default("allocprof", "no"), "yes") != 0) {
+		return;
+	}
+
+	profiler_ = alloc_profiler::create(*this);
+	dprintf("mem: allocation profiling enabled\n");
+
+	pgalloc_ = new ((void *)profiling_page_allocator_structure) page_allocator_profiling(*this, *pgalloc_, *profiler_);
+	objalloc_.set_profiler(profiler_);
+}
+
+/**
+ * Adds a shrinker, to be run whenever the page allocator is short of memory.
+ */
+void memory_manager::register_shrinker(shrinker &s)
+{
+	unique_irq_lock l(shrinkers_lock_);
+
+	s.next_shrinker_ = shrinkers_;
+	shrinkers_ = &s;
+}
+
+/**
+ * Asks every shrinker to give memory back to the page allocator.  Shrinkers are
+ * only registered (never removed), so the list can be walked without the lock.
+ *
+ * @return - The total number of pages released
+ */
+u64 memory_manager::run_shrinkers()
+{
+	u64 released = 0;
+
+	for (shrinker *s = shrinkers_; s; s = s->next_shrinker_) {
+		released += s->shrink();
+	}
+
+	return released;
 }
 
 void memory_manager::activate_primary_mapping()
 {
 	root_address_space_ = new address_space(ptalloc_, (u64)0);
 
-	// Insert a mapping that allows us to access physical memory 1-1
-	root_address_space_->pgtable().map(ptalloc_, 0xffff'8000'0000'0000, GB(0), mapping_flags::present | mapping_flags::writable, mapping_size::m1g);
-	root_address_space_->pgtable().map(ptalloc_, 0xffff'8000'4000'0000, GB(1), mapping_flags::present | mapping_flags::writable, mapping_size::m1g);
-	root_address_space_->pgtable().map(ptalloc_, 0xffff'8000'8000'0000, GB(2), mapping_flags::present | mapping_flags::writable, mapping_size::m1g);
-	root_address_space_->pgtable().map(ptalloc_, 0xffff'8000'c000'0000, GB(3), mapping_flags::present | mapping_flags::writable, mapping_size::m1g);
+	// Insert a mapping that allows us to access physical memory 1-1.  This must cover
+	// all of physical memory (and at least the first 4G, for device memory), as the page
+	// allocator may hand out any page that has a descriptor.
+	u64 direct_map_size = max(GB(4), (nr_page_descriptors_ << PAGE_BITS) + (GB(1) - 1)) & ~(GB(1) - 1);
+	for (u64 phys = 0; phys < direct_map_size; phys += GB(1)) {
+		root_address_space_->pgtable().map(ptalloc_, 0xffff'8000'0000'0000 + phys, phys, mapping_flags::present | mapping_flags::writable, mapping_size::m1g);
+	}
 
 	// This mapping is for the kernel high address space.  It's used mainly for executing kernel code.
 	root_address_space_->pgtable().map(ptalloc_, 0xffff'ffff'8000'0000, GB(0), mapping_flags::present | mapping_flags::writable, mapping_size::m1g);
@@ -155,4 +308,66 @@ void memory_manager::activate_primary_mapping()
 	root_address_space_->pgtable().activate();
 }
 
-bool memory_manager::try_handle_page_fault(u64 faulting_address) { return false; }
+/**
+ * Tries to resolve a page fault in the given (current) address space.  Faults on
+ * user addresses may be for pages that are backed on demand, which is up to the
+ * address space.  Kernel addresses are never paged.
+ *
+ * @return - true if the faulting access can be retried
+ */
+bool memory_manager::try_handle_page_fault(address_space &as, u64 faulting_address, page_fault_flags flags)
+{
+	if (faulting_address >= address_space::user_space_end) {
+		return false;
+	}
+
+	return as.handle_fault(faulting_address, flags);
+}
+
+/**
+ * Initialises the next section of page descriptors that was deferred at boot, and
+ * gives the memory it describes to the page allocator.
+ *
+ * @return - true if a section was initialised, or false if there are none left
+ */
+bool memory_manager::initialise_deferred_section()
+{
+	u64 start_pfn, end_pfn;
+
+	{
+		unique_irq_lock l(deferred_init_lock_);
+
+		if (next_deferred_pfn_ >= nr_page_descriptors_) {
+			return false;
+		}
+
+		start_pfn = next_deferred_pfn_;
+		end_pfn = min(start_pfn + deferred_section_pages, nr_page_descriptors_);
+		next_deferred_pfn_ = end_pfn;
+	}
+
+	initialise_page_descriptors(start_pfn, end_pfn);
+	populate_page_allocator(start_pfn, end_pfn);
+
+	return true;
+}
+
+/**
+ * Performs a small amount of background memory management work.  This is called
+ * from the idle thread, so that the work is only done when a core has nothing
+ * else to run.
+ *
+ * @return - true if some work was done, or false if there was nothing to do
+ */
+bool memory_manager::perform_idle_work()
+{
+	if (initialise_deferred_section()) {
+		return true;
+	}
+
+	if (percore_pgalloc_) {
+		return percore_pgalloc_->refill_zeroed_pool(page_allocator_percore::zeroed_pool_batch) > 0;
+	}
+
+	return false;
+}
@@ -8,6 +8,7 @@
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/object-allocator.h>
+#include <stacsos/node-storage.h>
 
 using namespace stacsos::kernel;
 using namespace stacsos::kernel::mem;
@@ -17,9 +18,9 @@ void *__dso_handle = &__dso_handle;
 int __cxa_atexit(void (*destructor)(void *), void *arg, void *dso) { return 0; }
 }
 
-void *operator new(size_t size) { return memory_manager::get().objalloc().alloc(size); }
+void *operator new(size_t size) { return memory_manager::get().objalloc().alloc(size, __builtin_return_address(0)); }
 
-void *operator new[](size_t size) { return memory_manager::get().objalloc().alloc(size); }
+void *operator new[](size_t size) { return memory_manager::get().objalloc().alloc(size, __builtin_return_address(0)); }
 
 void operator delete(void *p) { memory_manager::get().objalloc().free(p); }
 
@@ -28,3 +29,8 @@ void operator delete[](void *p) { memory_manager::get().objalloc().free(p); }
 void operator delete[](void *p, size_t sz) { memory_manager::get().objalloc().free(p); }
 
 void operator delete(void *p, size_t sz) { memory_manager::get().objalloc().free(p); }
+
+void *stacsos::reallocate_storage(void *ptr, size_t old_size, size_t new_size)
+{
+	return memory_manager::get().objalloc().realloc(ptr, new_size, __builtin_return_address(0));
+}
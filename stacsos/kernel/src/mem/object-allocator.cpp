@@ -5,68 +5,427 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/core.h>
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/alloc-profiler.h>
+#include <stacsos/kernel/mem/kmem-cache.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/object-allocator.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 #include <stacsos/kernel/mem/page.h>
+#include <stacsos/memops.h>
 
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
 using namespace stacsos::kernel::mem;
 
 #define VMALLOC_AREA 0xfffff00000000000
 
 object_allocator::object_allocator()
 	: loa_((void *)VMALLOC_AREA, GB(1))
+	, profiler_(nullptr)
 {
 }
 
-void *object_allocator::alloc(size_t size)
+void *object_allocator::alloc(size_t size, void *caller)
 {
-	unique_irq_lock l(object_allocator_lock_);
+	int size_class = size_class_of(size);
+	void *obj = allocate(size, size_class);
+
+	if (profiler_) {
+		profiler_->record_alloc(alloc_kind::object, caller ? caller : __builtin_return_address(0), obj, size, size_class);
+	}
+
+	return obj;
+}
 
-	if (size <= 16) {
-		return cache16_.allocate();
-	} else if (size <= 32) {
-		return cache32_.allocate();
-	} else if (size <= 64) {
-		return cache64_.allocate();
-	} else if (size <= 128) {
-		return cache128_.allocate();
-	} else if (size <= 256) {
-		return cache256_.allocate();
-	} else if (size <= 512) {
-		return cache512_.allocate();
-	} else if (size <= 1024) {
-		return cache1024_.allocate();
+void *object_allocator::allocate(size_t size, int size_class)
+{
+	if (size_class >= 0) {
+		return magazine_alloc(size_class, size);
 	}
 
+	unique_irq_lock l(large_object_lock_);
 	return loa_.allocate(size);
 }
 
+void *object_allocator::realloc(void *obj, size_t size, void *caller)
+{
+	if (!caller) {
+		caller = __builtin_return_address(0);
+	}
+
+	if (!obj) {
+		return alloc(size, caller);
+	}
+
+	if (!size) {
+		free(obj);
+		return nullptr;
+	}
+
+	size_t old_size;
+	if (resize_in_place(obj, size, old_size)) {
+		if (profiler_) {
+			profiler_->record_free(obj);
+			profiler_->record_alloc(alloc_kind::object, caller, obj, size, size_class_of(size));
+		}
+
+		return obj;
+	}
+
+	void *new_obj = alloc(size, caller);
+	if (!new_obj) {
+		return nullptr;
+	}
+
+	memops::memcpy(new_obj, obj, min(old_size, size));
+	free(obj);
+
+	return new_obj;
+}
+
+/**
+ * Decides whether an object can stay where it is: a small object can, if the new
+ * size is in the same size class (so that shrinking it to a smaller class frees the
+ * larger slot), and a large object can, if it is still too big for a slab cache and
+ * its pages can be grown to fit.
+ *
+ * @param old_size - Set to the usable size of the object as it is now
+ */
+bool object_allocator::resize_in_place(void *obj, size_t size, size_t &old_size)
+{
+	if (loa_.ptr_in_region(obj)) {
+		unique_irq_lock l(large_object_lock_);
+
+		old_size = loa_.size_of(obj);
+		if (!old_size) {
+			panic("unable to reallocate large object");
+		}
+
+		return size > max_size_class_size && (size <= old_size || loa_.grow(obj, size));
+	}
+
+	u32 cache_id = page::get_from_ptr(obj).slab_cache_id();
+	if (!cache_id || cache_id > nr_size_classes) {
+		kmem_cache_base *kc = kmem_cache_base::find(cache_id);
+		if (!kc) {
+			panic("unable to reallocate object");
+		}
+
+		// Objects from a kmem_cache always move, as the cache is for one type.
+		old_size = kc->object_size();
+		return false;
+	}
+
+	old_size = size_classes[cache_id - 1].object_size;
+	return size_class_of(size) == (int)cache_id - 1;
+}
+
 void object_allocator::free(void *ptr)
 {
-	unique_irq_lock l(object_allocator_lock_);
+	if (!ptr) {
+		return;
+	}
+
+	// This has to happen before the object can be reallocated (by another core).
+	if (profiler_) {
+		profiler_->record_free(ptr);
+	}
 
 	if (loa_.ptr_in_region(ptr)) {
+		unique_irq_lock l(large_object_lock_);
+
 		if (!loa_.free(ptr)) {
 			panic("unable to free large object");
 		}
+
+		return;
+	}
+
+	// Slab pages are tagged with the (one-based) size class of their cache.  Objects
+	// from a kmem_cache normally go back through their class's operator delete, but
+	// may end up here if they are deleted through a base class.
+	u32 cache_id = page::get_from_ptr(ptr).slab_cache_id();
+	if (!cache_id || cache_id > nr_size_classes) {
+		kmem_cache_base *kc = kmem_cache_base::find(cache_id);
+		if (!kc) {
+			panic("unable to free object");
+		}
+
+		kc->free_object(ptr);
+		return;
+	}
+
+	magazine_free(cache_id - 1, ptr);
+}
+
+object_allocator::core_magazines &object_allocator::this_core_magazines(int size_class)
+{
+	int id = core::this_core_id();
+	assert(id >= 0 && id < core_manager::max_cores);
+
+	return magazines_[id][size_class];
+}
+
+/**
+ * Allocates an object from this core's magazines.  If both are empty, the previous
+ * magazine is exchanged for a full one from the depot, and if the depot has none,
+ * the object comes straight from the slab cache.
+ */
+void *object_allocator::magazine_alloc(int size_class, size_t size)
+{
+	{
+		local_irq_guard g;
+		auto &mags = this_core_magazines(size_class);
+		mags.requested_bytes += size;
+
+		if (mags.loaded && !mags.loaded->empty()) {
+			mags.hits++;
+			return mags.loaded->pop();
+		}
+
+		if (mags.previous && !mags.previous->empty()) {
+			mags.hits++;
+			swap(mags.loaded, mags.previous);
+			return mags.loaded->pop();
+		}
+
+		magazine *full = depots_[size_class].take_full();
+		if (full) {
+			if (mags.previous) {
+				depots_[size_class].put_empty(mags.previous);
+			}
+
+			mags.depot_hits++;
+			mags.previous = mags.loaded;
+			mags.loaded = full;
+			return mags.loaded->pop();
+		}
+
+		mags.misses++;
+	}
+
+	return slab_alloc(size_class);
+}
+
+/**
+ * Frees an object into this core's magazines.  If both are full, the previous
+ * magazine is exchanged for an empty one from the depot (or a new one), and if no
+ * magazine can be had, the object goes straight back to the slab cache.
+ *
+ * A new magazine is allocated with interrupts enabled, outside the section that
+ * uses this core's magazines, as allocating it may run the shrinkers, which flush
+ * them.  The magazines are then looked at afresh.
+ */
+void object_allocator::magazine_free(int size_class, void *obj)
+{
+	magazine *spare = nullptr;
+
+	while (true) {
+		{
+			local_irq_guard g;
+			auto &mags = this_core_magazines(size_class);
+
+			bool freed = true;
+
+			if (mags.loaded && !mags.loaded->full()) {
+				mags.loaded->push(obj);
+			} else if (mags.previous && !mags.previous->full()) {
+				swap(mags.loaded, mags.previous);
+				mags.loaded->push(obj);
+			} else {
+				magazine *empty = depots_[size_class].take_empty();
+				if (!empty) {
+					empty = spare;
+					spare = nullptr;
+				}
+
+				if (empty) {
+					if (mags.previous) {
+						depots_[size_class].put_full(mags.previous);
+					}
+
+					mags.previous = mags.loaded;
+					mags.loaded = empty;
+					mags.loaded->push(obj);
+				} else {
+					freed = false;
+				}
+			}
+
+			if (freed) {
+				// A spare magazine that turned out not to be needed is kept for later.
+				if (spare) {
+					depots_[size_class].put_empty(spare);
+				}
+
+				return;
+			}
+		}
+
+		spare = new_magazine();
+		if (!spare) {
+			break;
+		}
+	}
+
+	slab_free(size_class, obj);
+}
+
+/**
+ * Magazines are themselves allocated from the 128-byte slab cache, bypassing the
+ * magazine layer.
+ */
+magazine *object_allocator::new_magazine()
+{
+	void *mem = slab_alloc(size_class_of(sizeof(magazine)));
+	if (!mem) {
+		return nullptr;
+	}
+
+	return new (mem) magazine();
+}
+
+/**
+ * Calls fn with the slab cache for the given size class.
+ */
+template <int sc, class F> auto object_allocator::with_cache(int size_class, F fn)
+{
+	if constexpr (sc == nr_size_classes - 1) {
+		if (size_class != sc) {
+			panic("invalid size class %d", size_class);
+		}
+
+		return fn(static_cast<size_class_caches<sc> &>(caches_).cache);
 	} else {
-		if (cache16_.try_free(ptr))
-			return;
-		if (cache32_.try_free(ptr))
-			return;
-		if (cache64_.try_free(ptr))
-			return;
-		if (cache128_.try_free(ptr))
-			return;
-		if (cache256_.try_free(ptr))
-			return;
-		if (cache512_.try_free(ptr))
-			return;
-		if (cache1024_.try_free(ptr))
-			return;
-
-		panic("unable to free object");
+		if (size_class == sc) {
+			return fn(static_cast<size_class_caches<sc> &>(caches_).cache);
+		}
+
+		return with_cache<sc + 1>(size_class, fn);
+	}
+}
+
+void *object_allocator::slab_alloc(int size_class)
+{
+	void *obj = with_cache(size_class, [this](auto &cache) { return cache.allocate(object_allocator_lock_); });
+	if (!obj) {
+		panic("out of memory");
+	}
+
+	return obj;
+}
+
+void object_allocator::slab_free(int size_class, void *obj)
+{
+	unique_irq_lock l(object_allocator_lock_);
+	with_cache(size_class, [obj](auto &cache) { cache.free(obj); });
+}
+
+/**
+ * Fills in the counters for one size class.  The magazine counters are summed over
+ * every core, and objects sitting in magazines count as cached rather than in use
+ * (the slab cache sees them as allocated).  Other cores may be changing their
+ * magazines while this runs, so the numbers are approximate.
+ */
+void object_allocator::get_stats(int size_class, slab_cache_stats &stats)
+{
+	{
+		unique_irq_lock l(object_allocator_lock_);
+		with_cache(size_class, [&stats](auto &cache) { cache.get_stats(stats); });
+	}
+
+	stats.objects_cached = depots_[size_class].nr_full() * magazine::capacity;
+	stats.magazine_hits = 0;
+	stats.depot_hits = 0;
+	stats.magazine_misses = 0;
+	stats.requested_bytes = 0;
+
+	for (int i = 0; i < core_manager::max_cores; i++) {
+		const auto &mags = magazines_[i][size_class];
+
+		if (mags.loaded) {
+			stats.objects_cached += mags.loaded->rounds;
+		}
+
+		if (mags.previous) {
+			stats.objects_cached += mags.previous->rounds;
+		}
+
+		stats.magazine_hits += mags.hits;
+		stats.depot_hits += mags.depot_hits;
+		stats.magazine_misses += mags.misses;
+		stats.requested_bytes += mags.requested_bytes;
+	}
+
+	stats.objects_in_use -= min(stats.objects_in_use, stats.objects_cached);
+}
+
+/**
+ * Gives back as much memory as possible.  The objects in this core's magazines and
+ * in the depots are returned to their slabs (the magazines on other cores can't be
+ * touched from here), and then every empty slab is released.
+ */
+u64 object_allocator::shrink()
+{
+	for (int size_class = 0; size_class < nr_size_classes; size_class++) {
+		flush_magazines(size_class);
+	}
+
+	u64 released = 0;
+
+	unique_irq_lock l(object_allocator_lock_);
+	for (int size_class = 0; size_class < nr_size_classes; size_class++) {
+		released += with_cache(size_class, [](auto &cache) { return cache.shrink(); });
+	}
+
+	return released;
+}
+
+void object_allocator::flush_magazines(int size_class)
+{
+	magazine *loaded, *previous;
+
+	{
+		local_irq_guard g;
+		auto &mags = this_core_magazines(size_class);
+
+		loaded = mags.loaded;
+		previous = mags.previous;
+		mags.loaded = mags.previous = nullptr;
+	}
+
+	release_magazine(size_class, loaded);
+	release_magazine(size_class, previous);
+
+	auto &depot = depots_[size_class];
+
+	while (magazine *mag = depot.take_full()) {
+		release_magazine(size_class, mag);
 	}
+
+	while (magazine *mag = depot.take_empty()) {
+		release_magazine(size_class, mag);
+	}
+}
+
+/**
+ * Returns the objects in a magazine to their slab cache, and then frees the magazine.
+ */
+void object_allocator::release_magazine(int size_class, magazine *mag)
+{
+	if (!mag) {
+		return;
+	}
+
+	unique_irq_lock l(object_allocator_lock_);
+
+	with_cache(size_class, [mag](auto &cache) {
+		while (!mag->empty()) {
+			cache.free(mag->pop());
+		}
+	});
+
+	with_cache(size_class_of(sizeof(magazine)), [mag](auto &cache) { cache.free(mag); });
 }
@@ -0,0 +1,314 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/page-allocator-bitmap.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::mem;
+
+static inline u64 words_for_bits(u64 bits) { return (bits + 63) / 64; }
+
+/**
+ * Returns the number of bytes of metadata needed to track the given number of pages.
+ */
+u64 page_allocator_bitmap::metadata_size(u64 nr_pages)
+{
+	u64 l0 = words_for_bits(nr_pages);
+	u64 l1 = words_for_bits(l0);
+	u64 l2 = words_for_bits(l1);
+
+	return (l0 + (2 * l1) + (2 * l2)) * sizeof(u64);
+}
+
+/**
+ * Constructs the allocator, with every page initially allocated.
+ *
+ * @param metadata - Storage for the bitmaps, of at least metadata_size(nr_pages) bytes
+ * @param nr_pages - The number of pages that the allocator can manage
+ */
+page_allocator_bitmap::page_allocator_bitmap(memory_manager &mm, void *metadata, u64 nr_pages)
+	: page_allocator(mm)
+	, nr_pages_(nr_pages)
+	, total_free_(0)
+	, total_pages_(0)
+	, allocations_(0)
+	, frees_(0)
+	, failures_(0)
+{
+	nr_words_[0] = words_for_bits(nr_pages);
+	nr_words_[1] = words_for_bits(nr_words_[0]);
+	nr_words_[2] = words_for_bits(nr_words_[1]);
+
+	memops::bzero(metadata, metadata_size(nr_pages));
+
+	u64 *words = (u64 *)metadata;
+
+	any_free_[0] = all_free_[0] = words;
+	words += nr_words_[0];
+
+	for (int level = 1; level < nr_levels; level++) {
+		any_free_[level] = words;
+		words += nr_words_[level];
+
+		all_free_[level] = words;
+		words += nr_words_[level];
+	}
+}
+
+void page_allocator_bitmap::insert_pages(page &range_start, u64 page_count)
+{
+	u64 inserted = mark_range(range_start.pfn(), page_count, true);
+
+	total_free_ += inserted;
+	total_pages_ += inserted;
+}
+
+void page_allocator_bitmap::remove_pages(page &range_start, u64 page_count)
+{
+	u64 removed = mark_range(range_start.pfn(), page_count, false);
+
+	total_free_ -= removed;
+	total_pages_ -= removed;
+}
+
+page *page_allocator_bitmap::allocate_pages(int order, page_allocation_flags flags)
+{
+	if (order < 0 || order > 63) {
+		failures_++;
+		return nullptr;
+	}
+
+	u64 page_count = 1ull << order;
+
+	u64 pfn = find_free_run(page_count, page_count);
+	if (pfn == npos) {
+		failures_++;
+		return nullptr;
+	}
+
+	total_free_ -= mark_range(pfn, page_count, false);
+	allocations_++;
+
+	return prepare_pages(&page::get_from_pfn(pfn), page_count, flags);
+}
+
+void page_allocator_bitmap::free_pages(page &base, int order) { free_page_run(base, 1ull << order); }
+
+page *page_allocator_bitmap::allocate_page_run(u64 page_count, page_allocation_flags flags)
+{
+	if (!page_count) {
+		failures_++;
+		return nullptr;
+	}
+
+	u64 pfn = find_free_run(page_count, 1);
+	if (pfn == npos) {
+		failures_++;
+		return nullptr;
+	}
+
+	total_free_ -= mark_range(pfn, page_count, false);
+	allocations_++;
+
+	return prepare_pages(&page::get_from_pfn(pfn), page_count, flags);
+}
+
+void page_allocator_bitmap::free_page_run(page &base, u64 page_count)
+{
+	u64 freed = mark_range(base.pfn(), page_count, true);
+
+	// Every page being freed must have been allocated.
+	assert(freed == page_count);
+
+	total_free_ += freed;
+	frees_++;
+}
+
+/**
+ * Fills in the statistics for this allocator.  Free runs aren't tracked by order,
+ * so each one is counted under the largest order that fits within it, which means
+ * that this walks the bitmap.
+ */
+void page_allocator_bitmap::get_stats(page_allocator_stats &stats) const
+{
+	memops::bzero(&stats, sizeof(stats));
+
+	stats.total_pages = total_pages_;
+	stats.free_pages = total_free_;
+
+	u64 pfn = find_next_free(0);
+	while (pfn != npos) {
+		u64 end_pfn = find_next_allocated(pfn);
+		stats.free_blocks[min(log2(end_pfn - pfn), (u64)page_allocator_stats::nr_orders - 1)]++;
+
+		pfn = find_next_free(end_pfn);
+	}
+
+	stats.allocations = allocations_;
+	stats.frees = frees_;
+	stats.failures = failures_;
+}
+
+void page_allocator_bitmap::dump() const
+{
+	dprintf("*** bitmap page allocator - %lu free pages ***\n", total_free_);
+
+	u64 pfn = find_next_free(0);
+	while (pfn != npos) {
+		u64 end_pfn = find_next_allocated(pfn);
+		dprintf("  %lx--%lx (%lu pages)\n", pfn << PAGE_BITS, (end_pfn << PAGE_BITS) - 1, end_pfn - pfn);
+
+		pfn = find_next_free(end_pfn);
+	}
+}
+
+/**
+ * Finds the index of the next bit at or after the given index, in the given level
+ * of a bitmap hierarchy, that is set (or, if invert is all ones, clear).  The
+ * level above is used to skip words that contain no candidates, and the top level
+ * is scanned linearly.
+ *
+ * @param levels - The bitmap hierarchy to search
+ * @param invert - Zero to search for set bits, or all ones to search for clear bits
+ * @param level - The level to search in
+ * @param index - The bit index to start the search from
+ * @return - The index of the bit, or npos if there are no more candidates
+ */
+u64 page_allocator_bitmap::find_next(u64 *const *levels, u64 invert, int level, u64 index) const
+{
+	if (index >= nr_bits(level)) {
+		return npos;
+	}
+
+	u64 word = index / 64;
+	u64 bits = (levels[level][word] ^ invert) & (~0ull << (index % 64));
+
+	if (!bits) {
+		if (level == nr_levels - 1) {
+			do {
+				if (++word >= nr_words_[level]) {
+					return npos;
+				}
+
+				bits = levels[level][word] ^ invert;
+			} while (!bits);
+		} else {
+			word = find_next(levels, invert, level + 1, word + 1);
+			if (word == npos) {
+				return npos;
+			}
+
+			bits = levels[level][word] ^ invert;
+		}
+	}
+
+	u64 result = (word * 64) + __builtin_ctzll(bits);
+	return result < nr_bits(level) ? result : npos;
+}
+
+/**
+ * Finds the next allocated page at or after the given PFN, i.e. the end of the free
+ * run containing it.  Returns the number of pages if there isn't one.
+ */
+u64 page_allocator_bitmap::find_next_allocated(u64 pfn) const
+{
+	u64 result = find_next(all_free_, ~0ull, 0, pfn);
+	return result == npos ? nr_pages_ : result;
+}
+
+/**
+ * Finds the lowest run of free pages of the given length, starting at a multiple
+ * of the given alignment.
+ *
+ * @param page_count - Number of pages required
+ * @param alignment - Required alignment (in pages) of the first page
+ * @return - The PFN of the first page, or npos if no such run exists
+ */
+u64 page_allocator_bitmap::find_free_run(u64 page_count, u64 alignment) const
+{
+	u64 pfn = 0;
+
+	while (true) {
+		u64 run_start = find_next_free(pfn);
+		if (run_start == npos) {
+			return npos;
+		}
+
+		run_start = (run_start + (alignment - 1)) & ~(alignment - 1);
+		if (run_start >= nr_pages_) {
+			return npos;
+		}
+
+		u64 run_end = find_next_allocated(run_start);
+		if (run_end - run_start >= page_count) {
+			return run_start;
+		}
+
+		pfn = run_end;
+	}
+}
+
+/**
+ * Marks a range of pages as free or allocated, and updates the summaries of each
+ * word that changed.
+ *
+ * @return - The number of pages whose state actually changed
+ */
+u64 page_allocator_bitmap::mark_range(u64 pfn, u64 page_count, bool free)
+{
+	assert(pfn + page_count <= nr_pages_);
+
+	u64 end_pfn = pfn + page_count;
+	u64 changed = 0;
+
+	while (pfn < end_pfn) {
+		u64 word = pfn / 64;
+		u64 bit = pfn % 64;
+		u64 count = min(64 - bit, end_pfn - pfn);
+		u64 mask = (count == 64) ? ~0ull : (((1ull << count) - 1) << bit);
+
+		u64 &bits = any_free_[0][word];
+		if (free) {
+			changed += __builtin_popcountll(~bits & mask);
+			bits |= mask;
+		} else {
+			changed += __builtin_popcountll(bits & mask);
+			bits &= ~mask;
+		}
+
+		update_summaries(word);
+		pfn += count;
+	}
+
+	return changed;
+}
+
+void page_allocator_bitmap::update_summaries(u64 word)
+{
+	for (int level = 1; level < nr_levels; level++) {
+		u64 above = word / 64;
+		u64 bit = 1ull << (word % 64);
+
+		if (any_free_[level - 1][word]) {
+			any_free_[level][above] |= bit;
+		} else {
+			any_free_[level][above] &= ~bit;
+		}
+
+		if (all_free_[level - 1][word] == ~0ull) {
+			all_free_[level][above] |= bit;
+		} else {
+			all_free_[level][above] &= ~bit;
+		}
+
+		word = above;
+	}
+}
@@ -6,6 +6,7 @@
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/page-allocator-buddy.h>
 #include <stacsos/kernel/mem/page.h>
 #include <stacsos/memops.h>
@@ -14,301 +15,512 @@ using namespace stacsos;
 using namespace stacsos::kernel;
 using namespace stacsos::kernel::mem;
 
-void page_allocator_buddy::dump() const {
-    dprintf("*** buddy page allocator - free list ***\n");
+static const char *migrate_type_names[] = { "movable", "unmovable" };
 
-    for (int i = 0; i <= LastOrder; i++) {
-        dprintf("[%02u] ", i);
+void page_allocator_buddy::dump() const
+{
+	dprintf("*** buddy page allocator - free list ***\n");
 
-        page *c = free_list_[i];
-        while (c) {
-            dprintf("%lx--%lx ", c->base_address(), (c->base_address() + ((1 << i) << PAGE_BITS)) - 1);
-            c = c->next_free_;
-        }
+	for (int t = 0; t < nr_migrate_types; t++) {
+		if (!nonempty_orders_[t]) {
+			continue;
+		}
 
-        dprintf("\n");
-    }
+		dprintf("(%s)\n", migrate_type_names[t]);
+
+		for (int i = 0; i <= LastOrder; i++) {
+			dprintf("[%02u] ", i);
+
+			page *c = free_list_[t][i];
+			while (c) {
+				dprintf("%lx--%lx ", c->base_address(), (c->base_address() + ((1 << i) << PAGE_BITS)) - 1);
+				c = c->next_free();
+			}
+
+			dprintf("\n");
+		}
+	}
+}
+
+void page_allocator_buddy::get_stats(page_allocator_stats &stats) const
+{
+	memops::bzero(&stats, sizeof(stats));
+
+	stats.total_pages = total_pages_;
+	stats.free_pages = total_free_;
+
+	for (int i = 0; i <= LastOrder; i++) {
+		stats.free_blocks[i] = free_blocks_[i];
+	}
+
+	stats.allocations = allocations_;
+	stats.frees = frees_;
+	stats.failures = failures_;
+	stats.splits = splits_;
+	stats.merges = merges_;
+	stats.fallbacks = fallbacks_;
 }
 
 /**
  * Inserts a range of pages into the free lists, breaking them down into the
- * largest blocks that fit within the remaining page count. Each block is added
- * at the appropriate order level.
+ * largest naturally aligned blocks that fit within the remaining page count.
+ * The blocks are appended to the free list for their order in one pass over the
+ * range, so that freshly inserted memory is handed out in address order.
+ *
+ * A block inside the range can't have a free buddy (otherwise the two would have
+ * formed a larger block), so merging is only attempted for the first and last
+ * blocks, which may have buddies outside the range, and for a block following
+ * one that has just been merged.
  *
  * @param range_start - Starting page in the range to insert
  * @param page_count - Number of pages to insert
  */
-void page_allocator_buddy::insert_pages(page &range_start, u64 page_count) {
-    u64 start_pfn = range_start.pfn();
-    u64 end_pfn = start_pfn + page_count;
-
-    while (start_pfn < end_pfn) {
-        int order = LastOrder;
-
-        // Find the largest order that fits within the remaining pages
-        while (order > 0 && ((start_pfn + pages_per_block(order)) > end_pfn || !block_aligned(order, start_pfn))) {
-            order--;
-        }
-
-        if (order >= 0) {
-            // Get the page corresponding to this start_pfn
-            page &block_start = page::get_from_pfn(start_pfn);
-            block_start.free_block_size_ = pages_per_block(order);
-
-            // Insert the block into the free list and attempt to merge with buddies
-            insert_free_block(order, block_start);
-            merge_buddies(order, block_start);
-
-            // Move the start pfn by the size of this block to continue with the next segment
-            start_pfn += pages_per_block(order);
-        } else {
-            // If no valid order found, skip this address and continue
-            start_pfn++;
-            page_count--;
-        }
-    }
+void page_allocator_buddy::insert_pages(page &range_start, u64 page_count)
+{
+	u64 pfn = range_start.pfn();
+	u64 end_pfn = pfn + page_count;
+	bool try_merge = true;
+
+	total_free_ += page_count;
+	total_pages_ += page_count;
+
+	while (pfn < end_pfn) {
+		int order = LastOrder;
+
+		// Find the largest order that is aligned, and fits within the remaining pages
+		while (order > 0 && ((pfn + pages_per_block(order)) > end_pfn || !block_aligned(order, pfn))) {
+			order--;
+		}
+
+		page *block = &page::get_from_pfn(pfn);
+		u64 next_pfn = pfn + pages_per_block(order);
+
+		if (try_merge || next_pfn == end_pfn) {
+			// Merge the block upwards for as long as its buddy is free.
+			int merged_order = order;
+			while (merged_order < LastOrder) {
+				page *merged = merge_buddies(merged_order, *block);
+				if (!merged) {
+					break;
+				}
+
+				block = merged;
+				merged_order++;
+			}
+
+			try_merge = merged_order != order;
+			order = merged_order;
+		}
+
+		append_free_block(order, *block);
+
+		// Move the start pfn by the size of this block to continue with the next segment
+		pfn = next_pfn;
+	}
 }
 
 /**
- * Removes a range of pages from the free lists, breaking them down into blocks
- * and removing each from the appropriate order level.
+ * Removes a range of pages from the free lists.  For each page in the range, the
+ * free block containing it is located (in O(LastOrder) time, by probing the page
+ * descriptors at each possible block alignment), removed from its free list, and
+ * any part of that block lying outside the range is given back to the free lists.
  *
  * @param range_start - Starting page in the range to remove
  * @param page_count - Number of pages to remove
  */
-void page_allocator_buddy::remove_pages(page &range_start, u64 page_count) {
-    while (page_count > 0) {
-        // Find the order of the current range_start
-        int order = find_order(range_start);
-
-        if (order == -1) {
-            // If no order found, skip to the next page and reduce page count
-            range_start = page::get_from_pfn(range_start.pfn() + 1);
-            page_count--;
-            continue;
-        }
-
-        // Calculate block size for the found order
-        u64 block_size = pages_per_block(order);
-
-        // If block size exceeds remaining page count, decrement order
-        while (block_size > page_count && order > 0) {
-            order--;
-            block_size = pages_per_block(order);
-        }
-
-        // Now remove the block from the free list
-        remove_free_block(order, range_start);
-
-        // Calculate the next start page for removal
-        u64 next_block_pfn = range_start.pfn() + block_size;
-        range_start = page::get_from_pfn(next_block_pfn);
-
-        // Decrement the page count by the size of the removed block
-        page_count -= block_size;
-
-        // Update total count of free pages
-        total_free_ -= block_size;
-    }
+void page_allocator_buddy::remove_pages(page &range_start, u64 page_count)
+{
+	u64 pfn = range_start.pfn();
+	u64 end_pfn = pfn + page_count;
+
+	while (pfn < end_pfn) {
+		int order;
+		page *block = find_free_block(page::get_from_pfn(pfn), order);
+
+		if (!block) {
+			// This page isn't free, so there's nothing to remove.
+			pfn++;
+			continue;
+		}
+
+		u64 block_start_pfn = block->pfn();
+		u64 block_end_pfn = block_start_pfn + pages_per_block(order);
+
+		remove_free_block(order, *block);
+		total_free_ -= pages_per_block(order);
+		total_pages_ -= pages_per_block(order);
+
+		// Return the parts of the block that precede, and follow, the range being removed.
+		if (block_start_pfn < pfn) {
+			insert_pages(*block, pfn - block_start_pfn);
+		}
+
+		if (block_end_pfn > end_pfn) {
+			insert_pages(page::get_from_pfn(end_pfn), block_end_pfn - end_pfn);
+		}
+
+		pfn = min(block_end_pfn, end_pfn);
+	}
 }
 
 /**
- * Finds the order of the block containing the given range start.
+ * Finds the free block that contains the given page.
  *
- * @param range_start - The starting page for which to find the order
- * @return - The order of the block if found, otherwise -1
+ * @param pg - The page to search for
+ * @param order - Receives the order of the containing free block
+ * @return - The first page of the containing free block, or nullptr if the page is not free
  */
-int page_allocator_buddy::find_order(page &range_start) const {
-    for (int order = 0; order <= LastOrder; ++order) {
-        page *current = free_list_[order];
-        while (current) {
-            if (current->base_address() == range_start.base_address()) {
-                return order; // Found the order containing range_start
-            }
-            current = current->next_free_;
-        }
-    }
-    return -1; // Not found
+page *page_allocator_buddy::find_free_block(page &pg, int &order) const
+{
+	u64 pfn = pg.pfn();
+
+	for (int candidate_order = 0; candidate_order <= LastOrder; candidate_order++) {
+		u64 candidate_pfn = pfn & ~(pages_per_block(candidate_order) - 1);
+
+		if (is_free_block(candidate_order, candidate_pfn)) {
+			order = candidate_order;
+			return &page::get_from_pfn(candidate_pfn);
+		}
+	}
+
+	return nullptr;
 }
 
 /**
- * Finds the index in the free list of a specific order where the range start is located.
- *
- * @param order - The order of the block to search in
- * @param range_start - The starting page to find
- * @return - The index of the free block if found, otherwise -1
+ * Determines whether the given PFN is the start of a free block of the given order.
  */
-int page_allocator_buddy::find_index(int order, page &range_start) const {
-    page *current = free_list_[order];
-    int index = 0;
-
-    while (current) {
-        if (current->base_address() == range_start.base_address()) {
-            return index; // Found the block
-        }
-        current = current->next_free_;
-        index++;
-    }
-
-    return -1; // Not found
+bool page_allocator_buddy::is_free_block(int order, u64 pfn) const
+{
+	if (pfn >= mm().nr_page_descriptors()) {
+		return false;
+	}
+
+	const page &pg = page::get_from_pfn(pfn);
+	return pg.state_ == page_state::free && pg.order_ == (u32)order;
 }
 
-void page_allocator_buddy::insert_free_block(int order, page &block_start) {
-    // assert order in range
-    assert(order >= 0 && order <= LastOrder);
+/**
+ * Links a free block into the free list for the given migrate type and order,
+ * either at the front or the back.
+ */
+void page_allocator_buddy::link_free_block(migrate_type type, int order, page &block_start, bool at_tail)
+{
+	// assert order in range
+	assert(order >= 0 && order <= LastOrder);
+
+	// assert block_start aligned to order
+	assert(block_aligned(order, block_start.pfn()));
+
+	int t = (int)type;
+
+	block_start.state_ = page_state::free;
+	block_start.order_ = order;
+
+	if (at_tail) {
+		block_start.set_next_free(nullptr);
+		block_start.set_prev_free(free_list_tail_[t][order]);
 
-    // assert block_start aligned to order
-    assert(block_aligned(order, block_start.pfn()));
+		if (free_list_tail_[t][order]) {
+			free_list_tail_[t][order]->set_next_free(&block_start);
+		} else {
+			free_list_[t][order] = &block_start;
+		}
 
-    page *target = &block_start;
-    page **slot = &free_list_[order];
-    while (*slot && *slot < target) {
-        slot = &((*slot)->next_free_);
-    }
+		free_list_tail_[t][order] = &block_start;
+	} else {
+		block_start.set_prev_free(nullptr);
+		block_start.set_next_free(free_list_[t][order]);
 
-    assert(*slot != target);
+		if (free_list_[t][order]) {
+			free_list_[t][order]->set_prev_free(&block_start);
+		} else {
+			free_list_tail_[t][order] = &block_start;
+		}
 
-    target->next_free_ = *slot;
-    *slot = target;
+		free_list_[t][order] = &block_start;
+	}
+
+	nonempty_orders_[t] |= (1u << order);
+	free_blocks_[order]++;
 }
 
-void page_allocator_buddy::remove_free_block(int order, page &block_start) {
-    // assert order in range
-    assert(order >= 0 && order <= LastOrder);
+/**
+ * Unlinks a free block from the free list for the given migrate type and order.
+ * The block is still marked as free.
+ */
+void page_allocator_buddy::unlink_free_block(migrate_type type, int order, page &block_start)
+{
+	int t = (int)type;
+
+	page *prev = block_start.prev_free();
+	page *next = block_start.next_free();
 
-    // assert block_start aligned to order
-    assert(block_aligned(order, block_start.pfn()));
+	if (prev) {
+		prev->set_next_free(next);
+	} else {
+		free_list_[t][order] = next;
+	}
 
-    page *target = &block_start;
-    page **candidate_slot = &free_list_[order];
-    while (*candidate_slot && *candidate_slot != target) {
-        candidate_slot = &((*candidate_slot)->next_free_);
-    }
+	if (next) {
+		next->set_prev_free(prev);
+	} else {
+		free_list_tail_[t][order] = prev;
+	}
 
-    // assert candidate block exists
-    assert(*candidate_slot == target);
+	if (!free_list_[t][order]) {
+		nonempty_orders_[t] &= ~(1u << order);
+	}
 
-    *candidate_slot = target->next_free_;
-    target->next_free_ = nullptr;
+	free_blocks_[order]--;
+
+	block_start.set_next_free(nullptr);
+	block_start.set_prev_free(nullptr);
 }
 
 /**
- * Removes a free block of a specific order from the free list.
- *
- * @param order - Order of the block to remove
- * @param block_start - The starting page of the block to remove
+ * Adds a free block to the free lists for the migrate type of its pageblock.  A
+ * block that spans several pageblocks takes them all over to its own type.
  */
-void page_allocator_buddy::split_block(int order, page &block_start) {
-    // Ensure the order is valid
-    assert(order > 0 && order <= LastOrder);
+void page_allocator_buddy::add_free_block(int order, page &block_start, bool at_tail)
+{
+	migrate_type type = block_type(block_start);
 
-    // Remove the block from the current free list
-    remove_free_block(order, block_start);
+	if (order > pageblock_order) {
+		for (u64 pfn = block_start.pfn(); pfn < block_start.pfn() + pages_per_block(order); pfn += pages_per_block(pageblock_order)) {
+			page::get_from_pfn(pfn).pageblock_type_ = type;
+		}
+	}
 
-    // Split into two buddies of the next lower order
-    int lower_order = order - 1;
-    u64 block_size = pages_per_block(lower_order);
+	link_free_block(type, order, block_start, at_tail);
+}
 
-    page &buddy1 = block_start;
-    page &buddy2 = page::get_from_pfn(buddy1.pfn() + block_size);
+/**
+ * Removes a free block from the free lists.
+ */
+void page_allocator_buddy::remove_free_block(int order, page &block_start)
+{
+	// assert order in range
+	assert(order >= 0 && order <= LastOrder);
 
-    insert_free_block(lower_order, buddy1);
-    insert_free_block(lower_order, buddy2);
+	// assert the block is actually on a free list
+	assert(block_start.state_ == page_state::free && block_start.order_ == (u32)order);
 
+	unlink_free_block(block_type(block_start), order, block_start);
+	block_start.state_ = page_state::none;
 }
 
 /**
- * Merges a free block with its buddy to form a larger block at the next higher order.
+ * Attempts to merge a block (which must not be on a free list) with its buddy.
+ * If the buddy is a free block of the same order, it is removed from its free
+ * list and the start of the combined block is returned.
  *
- * @param order - Current order of the block and its buddy
+ * @param order - Current order of the block
  * @param block_start - The starting page of the block to merge
+ * @return - The start of the merged block at order + 1, or nullptr if the buddy is not free
  */
-void page_allocator_buddy::merge_buddies(int order, page &block_start) {
-    // Ensure order is within range
-    assert(order >= 0 && order < LastOrder);
-
-    u64 block_size = pages_per_block(order);
-    u64 buddy_pfn = block_start.pfn() ^ block_size;
-    page &buddy = page::get_from_pfn(buddy_pfn);
-
-    // Ensure buddy is free and aligned to order
-    if (buddy.state_ == page_state::free && block_aligned(order, buddy.pfn())) {
-        // Remove both blocks from the free list
-        remove_free_block(order, block_start);
-        remove_free_block(order, buddy);
-
-        // Merge into a higher-order block
-        page &merged_block = (buddy.pfn() < block_start.pfn()) ? buddy : block_start;
-        insert_free_block(order + 1, merged_block);
-    }
+page *page_allocator_buddy::merge_buddies(int order, page &block_start)
+{
+	// Ensure order is within range
+	assert(order >= 0 && order < LastOrder);
+
+	u64 buddy_pfn = block_start.pfn() ^ pages_per_block(order);
+	if (!is_free_block(order, buddy_pfn)) {
+		return nullptr;
+	}
+
+	page &buddy = page::get_from_pfn(buddy_pfn);
+	remove_free_block(order, buddy);
+	merges_++;
+
+	return (buddy_pfn < block_start.pfn()) ? &buddy : &block_start;
 }
 
 /**
- * Allocates pages by finding a free block of the requested order.
- * If no blocks of that order are available, higher order blocks are split.
+ * Allocates pages by finding a free block of the requested order, in the free
+ * lists for the migrate type implied by the flags.  If no blocks of that order are
+ * available, the smallest higher order block (located via the non-empty order
+ * bitmap) is split.  If the migrate type has no suitable blocks at all, a block is
+ * stolen from another migrate type.
  *
  * @param order - Order of pages to allocate
  * @param flags - Allocation flags (optional)
  * @return - Pointer to the allocated block, or nullptr if no block available
  */
-page *page_allocator_buddy::allocate_pages(int order, page_allocation_flags flags) {
-    // Ensure requested order is within range
-    if (order < 0 || order > LastOrder) {
-        return nullptr;
-    }
-
-    // Find the smallest available block at or above the requested order
-    int current_order = order;
-    while (current_order <= LastOrder && !free_list_[current_order]) {
-        current_order++;
-    }
-
-    // No available blocks
-    if (current_order > LastOrder) {
-        return nullptr;
-    }
-
-    // Continuously split blocks until reaching the requested order
-    while (current_order > order) {
-        page &block = *free_list_[current_order];
-        split_block(current_order, block);
-        current_order--;
-    }
-
-    // Allocate the block at the desired order
-    page *allocated_block = free_list_[order];
-    remove_free_block(order, *allocated_block);
-    allocated_block->state_ = page_state::allocated;
-    total_free_ -= pages_per_block(order);
-    return allocated_block;
+page *page_allocator_buddy::allocate_pages(int order, page_allocation_flags flags)
+{
+	// Ensure requested order is within range
+	if (order < 0 || order > LastOrder) {
+		failures_++;
+		return nullptr;
+	}
+
+	migrate_type type = migrate_type_of(flags);
+
+	// Find the smallest available block at or above the requested order
+	page *block;
+	int block_order;
+
+	u32 candidate_orders = nonempty_orders_[(int)type] & ~((1u << order) - 1);
+	if (candidate_orders) {
+		block_order = __builtin_ctz(candidate_orders);
+		block = free_list_[(int)type][block_order];
+	} else {
+		block = steal_block(order, type, block_order);
+		if (!block) {
+			failures_++;
+			return nullptr;
+		}
+	}
+
+	remove_free_block(block_order, *block);
+
+	// Split the block down to the requested order, giving back the upper halves
+	while (block_order > order) {
+		block_order--;
+		insert_free_block(block_order, page::get_from_pfn(block->pfn() + pages_per_block(block_order)));
+		splits_++;
+	}
+
+	block->state_ = page_state::allocated;
+	block->order_ = order;
+	total_free_ -= pages_per_block(order);
+	allocations_++;
+
+	return prepare_pages(block, pages_per_block(order), flags);
+}
+
+/**
+ * Finds a block to satisfy an allocation from another migrate type, once the
+ * lists for the requested type have nothing large enough.  The largest block of
+ * the other type is taken.  If it covers whole pageblocks,
+ * they are converted to the requested type.  Otherwise, unless this is a small
+ * movable allocation, the rest of its pageblock is converted as well, provided
+ * that at least half of the pageblock is free.
+ *
+ * @param order - Order of the allocation
+ * @param type - Migrate type of the allocation
+ * @param block_order - Receives the order of the block that was found
+ * @return - The free block, which is still on a free list, or nullptr if there is none
+ */
+page *page_allocator_buddy::steal_block(int order, migrate_type type, int &block_order)
+{
+	static const migrate_type fallbacks[nr_migrate_types][nr_migrate_types - 1] = {
+		{ migrate_type::unmovable }, // movable
+		{ migrate_type::movable }, // unmovable
+	};
+
+	for (migrate_type fallback : fallbacks[(int)type]) {
+		u32 candidate_orders = nonempty_orders_[(int)fallback] & ~((1u << order) - 1);
+		if (!candidate_orders) {
+			continue;
+		}
+
+		// Take the largest block, so that the other type is broken up as little as possible
+		block_order = 31 - __builtin_clz(candidate_orders);
+		page *block = free_list_[(int)fallback][block_order];
+
+		fallbacks_++;
+
+		if (block_order >= pageblock_order) {
+			unlink_free_block(fallback, block_order, *block);
+
+			for (u64 pfn = block->pfn(); pfn < block->pfn() + pages_per_block(block_order); pfn += pages_per_block(pageblock_order)) {
+				page::get_from_pfn(pfn).pageblock_type_ = type;
+			}
+
+			link_free_block(type, block_order, *block, false);
+		} else if (block_order >= pageblock_order / 2 || type != migrate_type::movable) {
+			u64 pageblock_pfn = block->pageblock().pfn();
+
+			if (count_free_pages_in_pageblock(pageblock_pfn) >= pages_per_block(pageblock_order - 1)) {
+				move_pageblock(pageblock_pfn, type);
+			}
+		}
+
+		return block;
+	}
+
+	return nullptr;
+}
+
+/**
+ * Counts the free pages in a pageblock, by walking the free blocks within it.
+ */
+u64 page_allocator_buddy::count_free_pages_in_pageblock(u64 pageblock_pfn) const
+{
+	u64 end_pfn = min(pageblock_pfn + pages_per_block(pageblock_order), mm().nr_page_descriptors());
+	u64 count = 0;
+
+	for (u64 pfn = pageblock_pfn; pfn < end_pfn;) {
+		const page &pg = page::get_from_pfn(pfn);
+
+		if (pg.state_ == page_state::free) {
+			count += pages_per_block(pg.order_);
+			pfn += pages_per_block(pg.order_);
+		} else {
+			pfn++;
+		}
+	}
+
+	return count;
 }
 
 /**
- * Frees a block of pages and attempts to merge with buddies to form larger blocks.
+ * Changes the migrate type of a pageblock, moving each of the free blocks within
+ * it onto the free lists for the new type.
+ */
+void page_allocator_buddy::move_pageblock(u64 pageblock_pfn, migrate_type type)
+{
+	page &pageblock = page::get_from_pfn(pageblock_pfn);
+	migrate_type old_type = pageblock.pageblock_type_;
+
+	u64 end_pfn = min(pageblock_pfn + pages_per_block(pageblock_order), mm().nr_page_descriptors());
+
+	for (u64 pfn = pageblock_pfn; pfn < end_pfn;) {
+		page &pg = page::get_from_pfn(pfn);
+
+		if (pg.state_ == page_state::free) {
+			int order = pg.order_;
+
+			unlink_free_block(old_type, order, pg);
+			link_free_block(type, order, pg, false);
+
+			pfn += pages_per_block(order);
+		} else {
+			pfn++;
+		}
+	}
+
+	pageblock.pageblock_type_ = type;
+}
+
+/**
+ * Frees a block of pages and merges it with its buddies to form larger blocks.
  *
  * @param block_start - Starting page of the block to free
  * @param order - Order of the block to free
  */
-void page_allocator_buddy::free_pages(page &block_start, int order) {
-    // Ensure order is within range
-    assert(order >= 0 && order <= LastOrder);
-
-    block_start.state_ = page_state::free;
-    insert_free_block(order, block_start);
-    total_free_ += pages_per_block(order);
-
-    // Attempt to merge with buddies
-    while (order < LastOrder) {
-        u64 buddy_pfn = block_start.pfn() ^ pages_per_block(order);
-        page &buddy = page::get_from_pfn(buddy_pfn);
-
-        // Check if buddy is free and aligned
-        if (buddy.state_ != page_state::free || !block_aligned(order, buddy.pfn())) {
-            break;
-        }
-
-        // Merge the block with its buddy and move to the next order
-        merge_buddies(order, block_start);
-        order++;
-    }
-}
\ No newline at end of file
+void page_allocator_buddy::free_pages(page &block_start, int order)
+{
+	// Ensure order is within range
+	assert(order >= 0 && order <= LastOrder);
+	assert(block_start.state_ != page_state::free);
+
+	block_start.state_ = page_state::none;
+	total_free_ += pages_per_block(order);
+	frees_++;
+
+	// Merge with buddies for as long as they are free
+	page *block = &block_start;
+	while (order < LastOrder) {
+		page *merged = merge_buddies(order, *block);
+		if (!merged) {
+			break;
+		}
+
+		block = merged;
+		order++;
+	}
+
+	insert_free_block(order, *block);
+}
@@ -7,103 +7,303 @@
  */
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/page-allocator-linear.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/memops.h>
 
+using namespace stacsos;
 using namespace stacsos::kernel::mem;
 
-void page_allocator_linear::insert_pages(page &range_start, u64 page_count)
+static const u64 npos = ~0ull;
+
+page_allocator_linear::page_allocator_linear(memory_manager &mm)
+	: page_allocator(mm)
+	, by_address_(extent_node_allocator { this })
+	, by_size_(extent_node_allocator { this })
+	, spare_nodes_(nullptr)
+	, nr_spare_nodes_(0)
+	, total_free_(0)
+	, total_pages_(0)
+	, allocations_(0)
+	, frees_(0)
+	, failures_(0)
 {
-	page **slot = &free_list_;
+	add_spare_nodes(bootstrap_nodes_, sizeof(bootstrap_nodes_));
+}
 
-	while (*slot) {
-		slot = &(*slot)->next_free_;
+void page_allocator_linear::insert_pages(page &range_start, u64 page_count)
+{
+	if (!page_count) {
+		return;
 	}
 
-	*slot = &range_start;
-	range_start.free_block_size_ = page_count;
+	reserve_nodes();
+	release_pages(range_start.pfn(), page_count);
+
+	total_free_ += page_count;
+	total_pages_ += page_count;
 }
 
-void page_allocator_linear::remove_pages(page &range_start_r, u64 page_count)
+/**
+ * Removes a range of pages from the allocator.  The range may cover any number of
+ * free extents (and allocated pages in between, which are left alone), and the
+ * extents at either end are trimmed.
+ */
+void page_allocator_linear::remove_pages(page &range_start, u64 page_count)
 {
-	page *free_block = free_list_;
-
-	while (free_block) {
-		u64 free_block_start = free_block->pfn();
-		u64 free_block_end = free_block_start + free_block->free_block_size_;
-		u64 range_start = range_start_r.pfn();
-		u64 range_end = range_start + page_count;
+	reserve_nodes();
 
-		// dprintf("considering %lx -- %lx for %lx -- %lx\n", free_block_start, free_block_end, range_start, range_end);
+	u64 start = range_start.pfn();
+	u64 end = start + page_count;
 
-		if (range_start_r.pfn() >= free_block_start && range_start_r.pfn() < free_block_end) {
-			// dprintf("  range found\n");
+	// Start with the extent containing the first page, or else the next one after it.
+	u64 pfn, extent_size;
+	if (!by_address_.try_get_floor(start, pfn, extent_size) || pfn + extent_size <= start) {
+		if (!by_address_.try_get_ceiling(start, pfn, extent_size)) {
+			return;
+		}
+	}
 
-			u64 offset = range_start - free_block_start;
-			// dprintf("  offset=%lx\n", offset);
+	while (pfn < end) {
+		u64 extent_end = pfn + extent_size;
 
-			free_block->free_block_size_ = offset;
+		remove_extent(pfn, extent_size);
 
-			u64 remainder_pages = range_end > free_block_end ? 0 : free_block_end - range_end;
-			// dprintf("  remainder=%lx\n", remainder_pages);
+		if (pfn < start) {
+			add_extent(pfn, start - pfn);
+		}
 
-			if (remainder_pages) {
-				page *tmp_next_free = free_block->next_free_;
+		if (extent_end > end) {
+			add_extent(end, extent_end - end);
+		}
 
-				free_block->next_free_ = &page::get_from_pfn(range_end);
-				free_block->next_free_->free_block_size_ = remainder_pages;
-				free_block->next_free_->next_free_ = tmp_next_free;
-			}
+		u64 removed = min(extent_end, end) - max(pfn, start);
+		total_free_ -= removed;
+		total_pages_ -= removed;
 
+		if (!by_address_.try_get_ceiling(extent_end, pfn, extent_size)) {
 			break;
 		}
-
-		free_block = free_block->next_free_;
 	}
 }
 
 page *page_allocator_linear::allocate_pages(int order, page_allocation_flags flags)
 {
-	u64 page_count = 1 << order;
+	if (order < 0 || order > 31) {
+		failures_++;
+		return nullptr;
+	}
 
-	// find a free block with enough pages
-	// take from the end, so we can just reduce the free block size
+	// Large blocks are naturally aligned, so that they can be mapped with 2 MiB pages.
+	u64 page_count = 1ull << order;
+	return allocate_run(page_count, order >= aligned_block_order ? page_count : 1, flags);
+}
 
-	page *free_block = free_list_;
+void page_allocator_linear::free_pages(page &base, int order) { free_page_run(base, 1ull << order); }
 
-	while (free_block) {
-		if (free_block->free_block_size_ >= page_count) {
-			free_block->free_block_size_ -= page_count;
+page *page_allocator_linear::allocate_page_run(u64 page_count, page_allocation_flags flags) { return allocate_run(page_count, 1, flags); }
 
-			u64 start_pfn = free_block->pfn() + free_block->free_block_size_;
-			return &page::get_from_pfn(start_pfn);
-		}
+/**
+ * Allocates a run of pages, starting on a multiple of the given alignment (in pages,
+ * a power of two), from the smallest extent that can hold it.  The run is taken
+ * from as near the end of the extent as possible.
+ */
+page *page_allocator_linear::allocate_run(u64 page_count, u64 alignment, page_allocation_flags flags)
+{
+	if (!page_count || page_count > page::max_nr_pages) {
+		failures_++;
+		return nullptr;
+	}
+
+	reserve_nodes();
 
-		free_block = free_block->next_free_;
+	u64 pfn = take_pages(page_count, alignment);
+	if (pfn == npos) {
+		failures_++;
+		return nullptr;
 	}
 
-	return nullptr;
+	total_free_ -= page_count;
+	allocations_++;
+
+	return prepare_pages(&page::get_from_pfn(pfn), page_count, flags);
 }
 
-void page_allocator_linear::free_pages(page &base, int order)
+void page_allocator_linear::free_page_run(page &base, u64 page_count)
 {
-	// TODO
+	reserve_nodes();
+	release_pages(base.pfn(), page_count);
+
+	total_free_ += page_count;
+	frees_++;
 }
 
-void page_allocator_linear::dump() const
+void page_allocator_linear::get_stats(page_allocator_stats &stats) const
 {
-	page *free_block = free_list_;
+	memops::bzero(&stats, sizeof(stats));
 
-	if (!free_block) {
+	stats.total_pages = total_pages_;
+	stats.free_pages = total_free_;
+
+	by_address_.for_each([&stats](u64, u64 extent_size) {
+		stats.free_blocks[min(log2(extent_size), (u64)page_allocator_stats::nr_orders - 1)]++;
+	});
+
+	stats.allocations = allocations_;
+	stats.frees = frees_;
+	stats.failures = failures_;
+}
+
+void page_allocator_linear::dump() const
+{
+	if (by_address_.empty()) {
 		dprintf("[empty]\n");
 		return;
 	}
 
-	dprintf("free list:\n");
+	dprintf("free extents:\n");
+
+	by_address_.for_each([](u64 pfn, u64 extent_size) {
+		dprintf("  block start=0x%lx, end=0x%lx, size=0x%lx\n", pfn, pfn + extent_size, extent_size);
+	});
+}
+
+/**
+ * Finds the smallest extent that can hold the given number of pages at the given
+ * alignment (the lowest, if there are several of the same size), and takes the
+ * pages from as near its end as the alignment allows.  Anything left either side
+ * stays free.
+ *
+ * @return - The first PFN of the pages, or npos if no extent is large enough
+ */
+u64 page_allocator_linear::take_pages(u64 page_count, u64 alignment)
+{
+	u64 key, unused;
+	u64 search_key = size_key(0, page_count);
+
+	while (by_size_.try_get_ceiling(search_key, key, unused)) {
+		u64 pfn = key & 0xffff'ffff;
+		u64 extent_end = pfn + (key >> 32);
+		u64 start = (extent_end - page_count) & ~(alignment - 1);
+
+		if (start >= pfn) {
+			remove_extent(pfn, extent_end - pfn);
+
+			if (start > pfn) {
+				add_extent(pfn, start - pfn);
+			}
+
+			if (start + page_count < extent_end) {
+				add_extent(start + page_count, extent_end - (start + page_count));
+			}
+
+			return start;
+		}
+
+		search_key = key + 1;
+	}
+
+	return npos;
+}
+
+/**
+ * Returns a range of pages to the free extents, merging it with the extents
+ * immediately before and after it.
+ */
+void page_allocator_linear::release_pages(u64 pfn, u64 page_count)
+{
+	u64 start = pfn;
+	u64 end = pfn + page_count;
+
+	u64 prev_pfn, prev_size;
+	if (by_address_.try_get_floor(pfn, prev_pfn, prev_size)) {
+		// None of the pages being released may already be free.
+		assert(prev_pfn + prev_size <= pfn);
+
+		if (prev_pfn + prev_size == pfn) {
+			remove_extent(prev_pfn, prev_size);
+			start = prev_pfn;
+		}
+	}
+
+	u64 next_pfn, next_size;
+	if (by_address_.try_get_ceiling(pfn, next_pfn, next_size)) {
+		assert(next_pfn >= end);
+
+		if (next_pfn == end) {
+			remove_extent(next_pfn, next_size);
+			end = next_pfn + next_size;
+		}
+	}
+
+	add_extent(start, end - start);
+}
+
+void page_allocator_linear::add_extent(u64 pfn, u64 page_count)
+{
+	by_address_.add(pfn, page_count);
+	by_size_.add(size_key(pfn, page_count), 0);
+}
+
+void page_allocator_linear::remove_extent(u64 pfn, u64 page_count)
+{
+	by_address_.remove(pfn);
+	by_size_.remove(size_key(pfn, page_count));
+}
+
+page_allocator_linear::extent_node *page_allocator_linear::alloc_node(const u64 &key, const u64 &data)
+{
+	spare_node *n = spare_nodes_;
+	if (!n) {
+		panic("linear page allocator: out of extent nodes");
+	}
+
+	spare_nodes_ = n->next;
+	nr_spare_nodes_--;
+
+	return new (n) extent_node(key, data);
+}
+
+void page_allocator_linear::free_node(extent_node *n)
+{
+	n->~extent_node();
+
+	spare_node *spare = (spare_node *)n;
+	spare->next = spare_nodes_;
+	spare_nodes_ = spare;
+	nr_spare_nodes_++;
+}
+
+void page_allocator_linear::add_spare_nodes(void *storage, u64 size)
+{
+	for (u64 offset = 0; offset + sizeof(extent_node) <= size; offset += sizeof(extent_node)) {
+		spare_node *spare = (spare_node *)((u8 *)storage + offset);
+		spare->next = spare_nodes_;
+		spare_nodes_ = spare;
+		nr_spare_nodes_++;
+	}
+}
+
+/**
+ * Makes sure that there are enough spare tree nodes for one operation, by taking
+ * a page for more nodes if necessary.  The page comes from the lowest extent, as
+ * that is sure to be reachable through the direct map, even during boot.  Node
+ * pages are never given back.
+ */
+void page_allocator_linear::reserve_nodes()
+{
+	while (nr_spare_nodes_ < node_reserve) {
+		u64 pfn, extent_size;
+		if (!by_address_.try_get_ceiling(0, pfn, extent_size)) {
+			return;
+		}
 
-	while (free_block) {
-		u64 free_block_start = free_block->pfn();
-		u64 free_block_end = free_block_start + free_block->free_block_size_;
-		dprintf("  block start=0x%lx, end=0x%lx, size=0x%x\n", free_block_start, free_block_end, free_block_end - free_block_start);
+		remove_extent(pfn, extent_size);
+
+		if (extent_size > 1) {
+			add_extent(pfn + 1, extent_size - 1);
+		}
 
-		free_block = free_block->next_free_;
+		total_free_--;
+		add_spare_nodes(page::get_from_pfn(pfn).base_address_ptr(), PAGE_SIZE);
 	}
 }
@@ -0,0 +1,426 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator-percore.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::mem;
+
+void page_allocator_percore::insert_pages(page &range_start, u64 page_count)
+{
+	unique_irq_lock l(backing_lock_);
+	backing_.insert_pages(range_start, page_count);
+}
+
+void page_allocator_percore::remove_pages(page &range_start, u64 page_count)
+{
+	// Cached pages look allocated to the backing allocator, so give them back first
+	// to make sure that none of the pages being removed are left in a cache.
+	drain_all();
+
+	unique_irq_lock l(backing_lock_);
+	backing_.remove_pages(range_start, page_count);
+}
+
+page *page_allocator_percore::allocate_pages(int order, page_allocation_flags flags)
+{
+	page *pg = allocate(order, flags);
+
+	auto &counters = this_core_counters();
+	count_event(pg ? counters.allocations : counters.failures);
+
+	return pg;
+}
+
+page *page_allocator_percore::allocate(int order, page_allocation_flags flags)
+{
+	// Only single pages are cached.
+	if (order != 0) {
+		for (int attempt = 0;; attempt++) {
+			page *pg;
+			{
+				unique_irq_lock l(backing_lock_);
+				pg = backing_.allocate_pages(order, flags & ~page_allocation_flags::zero);
+			}
+
+			// The block is cleared (if need be) after dropping the lock, so that other
+			// cores aren't held up by it.
+			if (pg) {
+				return prepare_pages(pg, 1ull << order, flags);
+			}
+
+			if (!make_memory_available(attempt)) {
+				return nullptr;
+			}
+		}
+	}
+
+	// The zeroed pool only holds movable pages, so handing them out for any other
+	// type would leave long-lived pages in movable pageblocks.
+	migrate_type type = migrate_type_of(flags);
+	bool use_pool = type == migrate_type::movable;
+
+	if (use_pool && (flags & page_allocation_flags::zero) == page_allocation_flags::zero) {
+		page *pg = take_zeroed_page();
+		if (pg) {
+			return pg;
+		}
+	}
+
+	for (int attempt = 0;; attempt++) {
+		page *pg = take_cached_page(type);
+		if (pg) {
+			return prepare_pages(pg, 1, flags);
+		}
+
+		// The zeroed pool is made up of ordinary (movable) free pages, which don't
+		// need clearing.
+		if (use_pool) {
+			pg = take_zeroed_page();
+			if (pg) {
+				return pg;
+			}
+		}
+
+		if (!make_memory_available(attempt)) {
+			return nullptr;
+		}
+	}
+}
+
+void page_allocator_percore::free_pages(page &base, int order)
+{
+	count_event(this_core_counters().frees);
+
+	if (order != 0) {
+		unique_irq_lock l(backing_lock_);
+		backing_.free_pages(base, order);
+		return;
+	}
+
+	auto &cache = this_core_cache(base.pageblock_type());
+	unique_irq_lock l(cache.lock);
+
+	push_hot(cache, base);
+
+	if (cache.count > high_watermark) {
+		drain(cache, batch_size);
+	}
+}
+
+page *page_allocator_percore::allocate_page_run(u64 page_count, page_allocation_flags flags)
+{
+	for (int attempt = 0;; attempt++) {
+		page *pg;
+		{
+			unique_irq_lock l(backing_lock_);
+			pg = backing_.allocate_page_run(page_count, flags & ~page_allocation_flags::zero);
+		}
+
+		if (pg) {
+			count_event(this_core_counters().allocations);
+			return prepare_pages(pg, page_count, flags);
+		}
+
+		if (!make_memory_available(attempt)) {
+			count_event(this_core_counters().failures);
+			return nullptr;
+		}
+	}
+}
+
+void page_allocator_percore::free_page_run(page &base, u64 page_count)
+{
+	count_event(this_core_counters().frees);
+
+	unique_irq_lock l(backing_lock_);
+	backing_.free_page_run(base, page_count);
+}
+
+void page_allocator_percore::dump() const
+{
+	backing_.dump();
+
+	for (int i = 0; i < core_manager::max_cores; i++) {
+		for (int t = 0; t < nr_migrate_types; t++) {
+			if (caches_[i][t].count) {
+				dprintf("core [%d]: %lu cached pages (type %d)\n", i, caches_[i][t].count, t);
+			}
+		}
+	}
+
+	dprintf("zeroed pool: %lu pages\n", zeroed_pool_.count);
+}
+
+/**
+ * Reports the statistics of the backing allocator, but with the allocation counters
+ * seen by callers of this allocator, and the number of pages sitting in the caches
+ * (which the backing allocator counts as allocated).
+ */
+void page_allocator_percore::get_stats(page_allocator_stats &stats) const
+{
+	{
+		unique_irq_lock l(backing_lock_);
+		backing_.get_stats(stats);
+	}
+
+	stats.allocations = 0;
+	stats.frees = 0;
+	stats.failures = 0;
+	stats.cached_pages = zeroed_pool_.count;
+
+	for (int i = 0; i < core_manager::max_cores; i++) {
+		for (const auto &cache : caches_[i]) {
+			stats.cached_pages += cache.count;
+		}
+
+		stats.allocations += counters_[i].allocations;
+		stats.frees += counters_[i].frees;
+		stats.failures += counters_[i].failures;
+	}
+}
+
+/**
+ * Returns every cached page, on every core, and the zeroed pool, to the backing
+ * allocator.
+ */
+void page_allocator_percore::drain_all()
+{
+	for (auto &core_caches : caches_) {
+		for (auto &cache : core_caches) {
+			unique_irq_lock l(cache.lock);
+			drain(cache, cache.count);
+		}
+	}
+
+	unique_irq_lock l(zeroed_pool_.lock);
+	drain(zeroed_pool_, zeroed_pool_.count);
+}
+
+/**
+ * Tops up the pool of pre-zeroed pages, clearing at most max_pages pages.  Pages
+ * are cleared with non-temporal stores, so that doing this in the background
+ * doesn't evict anything useful from the cache.  This is meant to be called when
+ * the core has nothing better to do.
+ *
+ * @param max_pages - The maximum number of pages to clear
+ * @return - The number of pages added to the pool
+ */
+u64 page_allocator_percore::refill_zeroed_pool(u64 max_pages)
+{
+	u64 added = 0;
+
+	while (added < max_pages) {
+		{
+			unique_irq_lock l(zeroed_pool_.lock);
+			if (zeroed_pool_.count >= zeroed_pool_target) {
+				break;
+			}
+		}
+
+		// Zeroed pages are almost always wanted for user memory, which is movable.
+		page *pg = take_cached_page(migrate_type::movable);
+		if (!pg) {
+			break;
+		}
+
+		// Clear the page without holding any locks.
+		memops::pzero_nt(pg->base_address_ptr(), 1);
+
+		unique_irq_lock l(zeroed_pool_.lock);
+		push_hot(zeroed_pool_, *pg);
+		added++;
+	}
+
+	return added;
+}
+
+/**
+ * Called (without any locks held) when an allocation has failed, to try to give
+ * the backing allocator more memory to work with.  First, the pages held in the
+ * caches are returned (they may be enough to form a larger block), and then any
+ * page descriptors that were deferred at boot are initialised, one section at a
+ * time.  As a last resort, the shrinkers are asked to give memory back.
+ *
+ * @param attempt - How many times this allocation has already been retried
+ * @return - true if the allocation is worth retrying
+ */
+bool page_allocator_percore::make_memory_available(int attempt)
+{
+	if (attempt == 0) {
+		drain_all();
+		return true;
+	}
+
+	if (mm().initialise_deferred_section()) {
+		return true;
+	}
+
+	if (mm().run_shrinkers()) {
+		// Released pages may have gone into the caches.
+		drain_all();
+		return true;
+	}
+
+	return false;
+}
+
+page *page_allocator_percore::take_cached_page(migrate_type type)
+{
+	auto &cache = this_core_cache(type);
+	unique_irq_lock l(cache.lock);
+
+	if (cache.count <= low_watermark) {
+		refill(cache, type);
+	}
+
+	return pop_hot(cache);
+}
+
+page *page_allocator_percore::take_zeroed_page()
+{
+	unique_irq_lock l(zeroed_pool_.lock);
+	return pop_hot(zeroed_pool_);
+}
+
+page_allocator_percore::core_counters &page_allocator_percore::this_core_counters()
+{
+	int id = core::this_core_id();
+	assert(id >= 0 && id < core_manager::max_cores);
+
+	return counters_[id];
+}
+
+page_allocator_percore::page_cache &page_allocator_percore::this_core_cache(migrate_type type)
+{
+	int id = core::this_core_id();
+	assert(id >= 0 && id < core_manager::max_cores);
+
+	return caches_[id][(int)type];
+}
+
+void page_allocator_percore::push_hot(page_cache &cache, page &pg)
+{
+	pg.set_prev_free(nullptr);
+	pg.set_next_free(cache.hot);
+
+	if (cache.hot) {
+		cache.hot->set_prev_free(&pg);
+	} else {
+		cache.cold = &pg;
+	}
+
+	cache.hot = &pg;
+	cache.count++;
+}
+
+void page_allocator_percore::push_cold(page_cache &cache, page &pg)
+{
+	pg.set_next_free(nullptr);
+	pg.set_prev_free(cache.cold);
+
+	if (cache.cold) {
+		cache.cold->set_next_free(&pg);
+	} else {
+		cache.hot = &pg;
+	}
+
+	cache.cold = &pg;
+	cache.count++;
+}
+
+page *page_allocator_percore::pop_hot(page_cache &cache)
+{
+	page *pg = cache.hot;
+	if (!pg) {
+		return nullptr;
+	}
+
+	cache.hot = pg->next_free();
+	if (cache.hot) {
+		cache.hot->set_prev_free(nullptr);
+	} else {
+		cache.cold = nullptr;
+	}
+
+	pg->set_next_free(nullptr);
+	cache.count--;
+
+	return pg;
+}
+
+page *page_allocator_percore::pop_cold(page_cache &cache)
+{
+	page *pg = cache.cold;
+	if (!pg) {
+		return nullptr;
+	}
+
+	cache.cold = pg->prev_free();
+	if (cache.cold) {
+		cache.cold->set_next_free(nullptr);
+	} else {
+		cache.hot = nullptr;
+	}
+
+	pg->set_prev_free(nullptr);
+	cache.count--;
+
+	return pg;
+}
+
+/**
+ * Takes a batch of pages of the given migrate type from the backing allocator.
+ * These pages haven't been touched recently, so they go to the cold end of the
+ * cache.
+ */
+void page_allocator_percore::refill(page_cache &cache, migrate_type type)
+{
+	static const page_allocation_flags type_flags[nr_migrate_types] = {
+		page_allocation_flags::movable,
+		page_allocation_flags::none,
+	};
+
+	unique_irq_lock l(backing_lock_);
+
+	for (u64 i = 0; i < batch_size; i++) {
+		page *pg = backing_.allocate_pages(0, type_flags[(int)type]);
+		if (!pg) {
+			break;
+		}
+
+		push_cold(cache, *pg);
+	}
+}
+
+/**
+ * Returns up to count of the coldest pages in the cache to the backing allocator.
+ */
+void page_allocator_percore::drain(page_cache &cache, u64 count)
+{
+	if (!count) {
+		return;
+	}
+
+	unique_irq_lock l(backing_lock_);
+
+	while (count--) {
+		page *pg = pop_cold(cache);
+		if (!pg) {
+			break;
+		}
+
+		backing_.free_pages(*pg, 0);
+	}
+}
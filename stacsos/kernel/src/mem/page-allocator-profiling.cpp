@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/mem/alloc-profiler.h>
+#include <stacsos/kernel/mem/page-allocator-profiling.h>
+#include <stacsos/kernel/mem/page.h>
+
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::mem;
+
+page *page_allocator_profiling::allocate_pages(int order, page_allocation_flags flags)
+{
+	page *pg = backing_.allocate_pages(order, flags);
+
+	if (pg) {
+		profiler_.record_alloc(alloc_kind::pages, __builtin_return_address(0), pg->base_address_ptr(), PAGE_SIZE << order, order);
+	}
+
+	return pg;
+}
+
+void page_allocator_profiling::free_pages(page &base, int order)
+{
+	// The profiler must forget the block before it can be handed out again.
+	profiler_.record_free(base.base_address_ptr());
+	backing_.free_pages(base, order);
+}
+
+page *page_allocator_profiling::allocate_page_run(u64 page_count, page_allocation_flags flags)
+{
+	page *pg = backing_.allocate_page_run(page_count, flags);
+
+	if (pg) {
+		profiler_.record_alloc(alloc_kind::pages, __builtin_return_address(0), pg->base_address_ptr(), page_count << PAGE_BITS, -1);
+	}
+
+	return pg;
+}
+
+void page_allocator_profiling::free_page_run(page &base, u64 page_count)
+{
+	profiler_.record_free(base.base_address_ptr());
+	backing_.free_page_run(base, page_count);
+}
@@ -7,9 +7,94 @@
  */
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/memops.h>
 
+using namespace stacsos;
 using namespace stacsos::kernel::mem;
 
+/**
+ * Allocates a run of physically contiguous pages, of any length.  Allocators that
+ * can't do this natively round the request up to the next power-of-two order, so
+ * the run must be freed with free_page_run, passing the same page count.
+ *
+ * @param page_count - Number of pages to allocate
+ * @param flags - Allocation flags (optional)
+ * @return - The first page of the run, or nullptr if no run is available
+ */
+page *page_allocator::allocate_page_run(u64 page_count, page_allocation_flags flags)
+{
+	if (!page_count) {
+		return nullptr;
+	}
+
+	return allocate_pages(log2_ceil(page_count), flags);
+}
+
+/**
+ * Frees a run of pages that was allocated with allocate_page_run.
+ *
+ * @param base - The first page of the run
+ * @param page_count - Number of pages in the run, as passed to allocate_page_run
+ */
+void page_allocator::free_page_run(page &base, u64 page_count) { free_pages(base, log2_ceil(page_count)); }
+
+/**
+ * Finishes off a successful allocation, by clearing the pages if the caller asked
+ * for zeroed memory.  Allocators call this on the block they are about to return.
+ *
+ * @param block_start - The first page of the allocated block (may be nullptr)
+ * @param page_count - Number of pages in the allocated block
+ * @param flags - The flags passed to the allocation
+ * @return - The allocated block
+ */
+page *page_allocator::prepare_pages(page *block_start, u64 page_count, page_allocation_flags flags)
+{
+	if (block_start && (flags & page_allocation_flags::zero) == page_allocation_flags::zero) {
+		memops::pzero(block_start->base_address_ptr(), page_count);
+	}
+
+	return block_start;
+}
+
+/**
+ * Fills in the statistics for this allocator.  Allocators that don't keep any
+ * statistics report nothing.
+ */
+void page_allocator::get_stats(page_allocator_stats &stats) const { memops::bzero(&stats, sizeof(stats)); }
+
+/**
+ * Computes the fragmentation index for an allocation of the given order, in
+ * thousandths.  Values towards 0 mean that an allocation of this order would fail
+ * for lack of free memory, and values towards 1000 mean it would fail because the
+ * free memory is fragmented.  If a large enough block is free, then the index is
+ * meaningless and -1000 is returned.
+ */
+int page_allocator_stats::fragmentation_index(int order) const
+{
+	u64 total_blocks = 0;
+	u64 suitable_blocks = 0;
+
+	for (int i = 0; i < nr_orders; i++) {
+		total_blocks += free_blocks[i];
+
+		if (i >= order) {
+			suitable_blocks += free_blocks[i];
+		}
+	}
+
+	if (suitable_blocks) {
+		return -1000;
+	}
+
+	if (!total_blocks) {
+		return 0;
+	}
+
+	u64 requested = 1ull << order;
+	return 1000 - (int)((1000 + ((free_pages * 1000) / requested)) / total_blocks);
+}
+
 void page_allocator::perform_selftest()
 {
 	dprintf("******************************************\n");
@@ -88,6 +173,44 @@ void page_allocator::perform_selftest()
 	insert_pages(page::get_from_pfn(40), 8);
 	dump();
 
+	const int timed_rounds = 1000;
+	const int timed_batch = 8;
+
+	dprintf("(15) Timed allocate/free (ORDER=0, ROUNDS=%u, BATCH=%u)\n", timed_rounds, timed_batch);
+
+	page *timed_pages[timed_batch];
+	u64 timed_ops = 0;
+
+	u64 timed_start = __builtin_ia32_rdtsc();
+	for (int round = 0; round < timed_rounds; round++) {
+		int allocated = 0;
+		while (allocated < timed_batch) {
+			timed_pages[allocated] = allocate_pages(0, page_allocation_flags::none);
+			if (!timed_pages[allocated]) {
+				break;
+			}
+
+			allocated++;
+		}
+
+		for (int i = 0; i < allocated; i++) {
+			free_pages(*timed_pages[i], 0);
+		}
+
+		timed_ops += allocated;
+
+		if (allocated < timed_batch) {
+			dprintf("  allocation failed after %lu allocate/free pairs\n", timed_ops);
+			break;
+		}
+	}
+	u64 timed_end = __builtin_ia32_rdtsc();
+
+	if (timed_ops) {
+		dprintf("  %lu allocate/free pairs, %lu cycles per pair\n", timed_ops, (timed_end - timed_start) / timed_ops);
+	}
+	dump();
+
 	dprintf("*** SELF TEST COMPLETE - SYSTEM TERMINATED ***\n");
 	abort();
 }
@@ -5,6 +5,7 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 #include <stacsos/kernel/mem/page.h>
@@ -12,20 +13,44 @@
 
 using namespace stacsos::kernel::mem;
 
-template <size_t object_size, int slab_page_order> void *slab_cache<object_size, slab_page_order>::allocate_slab()
+void *slab_pages::allocate(int order)
 {
-	page *slab_page = (memory_manager::get().pgalloc().allocate_pages(slab_page_order));
-	if (!slab_page) {
-		panic("unable to allocate slab");
+	page *pg = memory_manager::get().pgalloc().allocate_pages(order);
+	if (!pg) {
+		return nullptr;
 	}
 
-	return slab_page->base_address_ptr();
+	return pg->base_address_ptr();
 }
 
-template class slab_cache<16, 0>;
-template class slab_cache<32, 0>;
-template class slab_cache<64, 0>;
-template class slab_cache<128, 0>;
-template class slab_cache<256, 0>;
-template class slab_cache<512, 0>;
-template class slab_cache<1024, 0>;
+/**
+ * Records the owning cache in the descriptor of each page of a slab, so that a freed
+ * object's slab can be found from its address.
+ */
+void slab_pages::tag(void *slab_memory, int order, u32 cache_id)
+{
+	page &slab_page = page::get_from_ptr(slab_memory);
+	for (u64 i = 0; i < (1u << order); i++) {
+		(&slab_page)[i].set_slab(cache_id, i);
+	}
+}
+
+void slab_pages::release(void *slab_memory, int order)
+{
+	tag(slab_memory, order, 0);
+	memory_manager::get().pgalloc().free_pages(page::get_from_ptr(slab_memory), order);
+}
+
+/**
+ * Finds the start of the slab containing an object, via the descriptor of the page
+ * it is in.
+ */
+void *slab_pages::slab_base(void *obj, u32 cache_id)
+{
+	page &pg = page::get_from_ptr(obj);
+	if (pg.slab_cache_id() != cache_id) {
+		panic("object not in cache");
+	}
+
+	return pg.slab_head().base_address_ptr();
+}
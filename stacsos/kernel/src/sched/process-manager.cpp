@@ -83,28 +83,41 @@ shared_ptr<process> process_manager::create_process(const char *path, const char
 			u64 vaddr_page_offset = phdr->p_vaddr & ~PAGE_MASK;
 			u64 size = (phdr->p_memsz + vaddr_page_offset + (PAGE_SIZE - 1)) & PAGE_MASK;
 
-			auto rgn = proc->addrspace().add_region(vaddr_page, size, region_flags::all, true);
+			auto rgn = proc->addrspace().add_region(vaddr_page, size, region_flags::all, false);
 			if (!rgn) {
 				panic("unable to add region for segment");
 			}
 
-			// rgn->storage
-			void *target = (char *)rgn->storage->base_address_ptr() + vaddr_page_offset;
-			// dprintf("copy to %p\n", target);
-			file->pread(target, phdr->p_offset, phdr->p_filesz);
+			// Only the pages holding file data are backed now.  The rest of the segment
+			// (the bss) is zeroed on demand.
+			u64 file_end = phdr->p_vaddr + phdr->p_filesz;
+			for (u64 page_addr = vaddr_page; page_addr < file_end; page_addr += PAGE_SIZE) {
+				page *pg = proc->addrspace().populate_page(page_addr);
+				if (!pg) {
+					panic("unable to allocate memory for segment");
+				}
+
+				u64 copy_start = max(page_addr, phdr->p_vaddr);
+				u64 copy_end = min(page_addr + PAGE_SIZE, file_end);
+
+				void *target = (char *)pg->base_address_ptr() + (copy_start - page_addr);
+				// dprintf("copy to %p\n", target);
+				file->pread(target, phdr->p_offset + (copy_start - phdr->p_vaddr), copy_end - copy_start);
+			}
 		}
 	}
 
 	delete[] program_headers;
 
-	auto data_page = proc->addrspace().alloc_region(0x1000, region_flags::readable, true);
+	u64 data_base = proc->addrspace().alloc_region(0x1000, region_flags::readable, false);
+	page *data_page = data_base ? proc->addrspace().populate_page(data_base) : nullptr;
 	if (!data_page) {
 		panic("unable to allocate data page");
 	}
 
-	memops::strncpy((char *)data_page->storage->base_address_ptr(), args, memops::strlen(args) + 1);
+	memops::strncpy((char *)data_page->base_address_ptr(), args, memops::strlen(args) + 1);
 
-	proc->create_thread(ehdr->e_entry, (void *)data_page->base);
+	proc->create_thread(ehdr->e_entry, (void *)data_base);
 
 	auto pp = shared_ptr(proc);
 	active_processes_.append(pp);
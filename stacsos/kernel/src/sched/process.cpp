@@ -13,6 +13,8 @@ using namespace stacsos;
 using namespace stacsos::kernel::sched;
 using namespace stacsos::kernel::mem;
 
+DEFINE_KMEM_CACHE_OPERATORS(process, "process")
+
 shared_ptr<thread> process::create_thread(u64 entry_point, void *entry_arg)
 {
 	u64 user_stack = 0;
@@ -23,7 +25,7 @@ shared_ptr<thread> process::create_thread(u64 entry_point, void *entry_arg)
 		next_user_stack_ += stack_size + 0x1000; // Allocate the stack size, but plus a "guard page".
 
 		user_stack = stack_base + stack_size;
-		addrspace().add_region(stack_base, stack_size, region_flags::readwrite, true);
+		addrspace().add_region(stack_base, stack_size, region_flags::readwrite, false);
 	}
 
 	shared_ptr<thread> t = shared_ptr(new thread(*this, entry_point, entry_arg, user_stack));
@@ -14,6 +14,8 @@
 using namespace stacsos::kernel::sched;
 using namespace stacsos::kernel::arch::x86;
 
+DEFINE_KMEM_CACHE_OPERATORS(sleeping_thread, "sleeping-thread")
+
 void sleeper::sleep_ms(u64 duration_ms)
 {
 	auto &tsc = x86_core::this_core().local_tsc();
@@ -51,5 +53,6 @@ void sleeper::check_wakeup()
 
 	for (auto resume : resumed) {
 		sleeping_.remove(resume);
+		delete resume;
 	}
 }
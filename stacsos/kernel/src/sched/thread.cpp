@@ -17,6 +17,8 @@ using namespace stacsos::kernel::sched;
 using namespace stacsos::kernel::mem;
 using stacsos::kernel::arch::x86::machine_context;
 
+DEFINE_KMEM_CACHE_OPERATORS(thread, "thread")
+
 thread::thread(process &owner, u64 ep, void *ep_arg, u64 user_stack)
 	: owner_(owner)
 	, ep_(ep)
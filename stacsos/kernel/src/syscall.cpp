@@ -121,9 +121,20 @@ extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 ar
 	}
 
 	case syscall_numbers::alloc_mem: {
-		auto rgn = current_thread.owner().addrspace().alloc_region(PAGE_ALIGN_UP(arg0), region_flags::readwrite, true);
+		u64 base = current_thread.owner().addrspace().alloc_region(PAGE_ALIGN_UP(arg0), region_flags::readwrite, false);
+		if (!base) {
+			return syscall_result { syscall_result_code::not_supported, 0 };
+		}
+
+		return syscall_result { syscall_result_code::ok, base };
+	}
 
-		return syscall_result { syscall_result_code::ok, rgn->base };
+	case syscall_numbers::free_mem: {
+		if (!current_thread.owner().addrspace().remove_region(arg0, arg1)) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return syscall_result { syscall_result_code::ok, 0 };
 	}
 
 	case syscall_numbers::start_process: {
@@ -22,15 +22,25 @@ public:
 		, data_(data)
 		, left_(nullptr)
 		, right_(nullptr)
+		, height_(1)
 	{
 	}
 
-	int height() const
+	static void *operator new(size_t size) { return allocate_node_storage(size); }
+	static void *operator new(size_t size, void *ptr) { return ptr; }
+	static void operator delete(void *ptr, size_t size) { free_node_storage(ptr, size); }
+
+	int height() const { return height_; }
+
+	/**
+	 * Recomputes the height of this node from its children, which must be up to date.
+	 */
+	void update_height()
 	{
 		int lh = left_ == nullptr ? 0 : left_->height();
 		int rh = right_ == nullptr ? 0 : right_->height();
 
-		return max(lh, rh) + 1;
+		height_ = max(lh, rh) + 1;
 	}
 
 	int balance_factor() const
@@ -55,6 +65,7 @@ private:
 	D data_;
 
 	avl_tree_node *left_, *right_;
+	int height_;
 };
 
 template <class N> struct avl_tree_iterator_pair {
@@ -117,7 +128,17 @@ private:
 	}
 };
 
-template <class K, class D> class avl_tree {
+/**
+ * The default way of allocating tree nodes, from the heap.  Trees that can't use
+ * the heap (e.g. inside the memory manager) supply their own allocator, which must
+ * provide the same two functions.
+ */
+template <class N> struct avl_tree_heap_allocator {
+	N *allocate(const typename N::key_type &key, const typename N::data_type &data) { return new N(key, data); }
+	void free(N *n) { delete n; }
+};
+
+template <class K, class D, class A = avl_tree_heap_allocator<avl_tree_node<K, D>>> class avl_tree {
 	DELETE_DEFAULT_COPY_AND_MOVE(avl_tree)
 
 public:
@@ -129,8 +150,29 @@ public:
 	{
 	}
 
+	explicit avl_tree(const A &allocator)
+		: root_(nullptr)
+		, allocator_(allocator)
+	{
+	}
+
 	void add(const K &key, const D &data) { root_ = do_insert(root_, key, data); }
 
+	/**
+	 * Removes the node with the given key, if there is one.
+	 *
+	 * @return - true if a node was removed
+	 */
+	bool remove(const K &key)
+	{
+		bool removed = false;
+		root_ = do_remove(root_, key, removed);
+
+		return removed;
+	}
+
+	bool empty() const { return root_ == nullptr; }
+
 	bool try_get_value(const K &key, D &data)
 	{
 		node *ref = root_;
@@ -148,6 +190,58 @@ public:
 		return false;
 	}
 
+	/**
+	 * Finds the node with the greatest key that is less than or equal to the given key.
+	 */
+	bool try_get_floor(const K &key, K &found_key, D &data) const
+	{
+		const node *candidate = nullptr;
+
+		const node *ref = root_;
+		while (ref) {
+			if (ref->key() == key) {
+				candidate = ref;
+				break;
+			} else if (key < ref->key()) {
+				ref = ref->left();
+			} else {
+				candidate = ref;
+				ref = ref->right();
+			}
+		}
+
+		return take_result(candidate, found_key, data);
+	}
+
+	/**
+	 * Finds the node with the smallest key that is greater than or equal to the given key.
+	 */
+	bool try_get_ceiling(const K &key, K &found_key, D &data) const
+	{
+		const node *candidate = nullptr;
+
+		const node *ref = root_;
+		while (ref) {
+			if (ref->key() == key) {
+				candidate = ref;
+				break;
+			} else if (key < ref->key()) {
+				candidate = ref;
+				ref = ref->left();
+			} else {
+				ref = ref->right();
+			}
+		}
+
+		return take_result(candidate, found_key, data);
+	}
+
+	/**
+	 * Calls fn(key, data) for every node, in key order.  Unlike iteration, this
+	 * doesn't allocate any memory.
+	 */
+	template <class F> void for_each(F fn) const { do_for_each(root_, fn); }
+
 	void dump() const { do_dump(root_); }
 
 	const_iterator begin() const { return const_iterator(root_); }
@@ -155,14 +249,38 @@ public:
 
 private:
 	node *root_;
+	A allocator_;
+
+	node *alloc_node(const K &key, const D &data) { return allocator_.allocate(key, data); }
+
+	static bool take_result(const node *n, K &found_key, D &data)
+	{
+		if (!n) {
+			return false;
+		}
 
-	node *alloc_node(const K &key, const D &data) { return new node(key, data); }
+		found_key = n->key();
+		data = n->data();
+		return true;
+	}
+
+	template <class F> static void do_for_each(const node *ref, F &fn)
+	{
+		if (ref) {
+			do_for_each(ref->left(), fn);
+			fn(ref->key(), ref->data());
+			do_for_each(ref->right(), fn);
+		}
+	}
 
 	node *ll_rot(node *ref)
 	{
 		node *t = ref->left();
 		ref->left(t->right());
 		t->right(ref);
+
+		ref->update_height();
+		t->update_height();
 		return t;
 	}
 
@@ -186,14 +304,18 @@ private:
 		ref->right(t->left());
 		t->left(ref);
 
+		ref->update_height();
+		t->update_height();
 		return t;
 	}
 
 	node *balance(node *ref)
 	{
+		ref->update_height();
+
 		int bf = ref->balance_factor();
 		if (bf > 1) {
-			if (ref->left()->balance_factor() > 0) {
+			if (ref->left()->balance_factor() >= 0) {
 				return ll_rot(ref);
 			} else {
 				return lr_rot(ref);
@@ -221,5 +343,49 @@ private:
 			return balance(ref);
 		}
 	}
+
+	node *do_remove(node *ref, const K &key, bool &removed)
+	{
+		if (ref == nullptr) {
+			return nullptr;
+		}
+
+		if (ref->key() == key) {
+			removed = true;
+
+			node *l = ref->left();
+			node *r = ref->right();
+			allocator_.free(ref);
+
+			if (r == nullptr) {
+				return l;
+			}
+
+			// Replace the node with the smallest node in its right subtree.
+			node *successor;
+			r = remove_min(r, successor);
+
+			successor->left(l);
+			successor->right(r);
+			return balance(successor);
+		} else if (key < ref->key()) {
+			ref->left(do_remove(ref->left(), key, removed));
+		} else {
+			ref->right(do_remove(ref->right(), key, removed));
+		}
+
+		return balance(ref);
+	}
+
+	node *remove_min(node *ref, node *&min)
+	{
+		if (ref->left() == nullptr) {
+			min = ref;
+			return ref->right();
+		}
+
+		ref->left(remove_min(ref->left(), min));
+		return balance(ref);
+	}
 };
 } // namespace stacsos
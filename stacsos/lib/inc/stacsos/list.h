@@ -7,6 +7,8 @@
  */
 #pragma once
 
+#include <stacsos/node-storage.h>
+
 namespace stacsos {
 template <typename T> struct list_node {
 	typedef T elem;
@@ -17,6 +19,9 @@ template <typename T> struct list_node {
 	{
 	}
 
+	static void *operator new(size_t size) { return allocate_node_storage(size); }
+	static void operator delete(void *ptr, size_t size) { free_node_storage(ptr, size); }
+
 	self *next;
 	elem data;
 };
@@ -14,6 +14,8 @@ public:
 
 	static void pzero(void *ptr, size_t count) { bzero(ptr, count << PAGE_BITS); }
 
+	static void pzero_nt(void *ptr, size_t count) { pzero(ptr, count); }
+
 	static void *memset(void *dest, int c, size_t size)
 	{
 #pragma GCC diagnostic push
@@ -62,6 +64,7 @@ public:
 
 extern "C" void __x86_bzero(void *, size_t);
 extern "C" void __x86_pzero(void *, size_t);
+extern "C" void __x86_pzero_nt(void *, size_t);
 extern "C" void *__x86_memset(void *, int, size_t);
 extern "C" void *__x86_memcpy(void *, const void *, size_t);
 extern "C" int __x86_memcmp(const void *, const void *, size_t);
@@ -76,6 +79,8 @@ public:
 
 	static void pzero(void *ptr, size_t count) { return __x86_pzero(ptr, count); }
 
+	static void pzero_nt(void *ptr, size_t count) { return __x86_pzero_nt(ptr, count); }
+
 	static void *memset(void *dest, int c, size_t size) { return __x86_memset(dest, c, size); }
 
 	static void *memcpy(void *dest, const void *src, size_t size) { return __x86_memcpy(dest, src, size); }
@@ -93,6 +98,7 @@ template <class Impl> class memops_carrier {
 public:
 	static void bzero(void *ptr, size_t size) { Impl::bzero(ptr, size); }
 	static void pzero(void *ptr, size_t count) { Impl::pzero(ptr, count); }
+	static void pzero_nt(void *ptr, size_t count) { Impl::pzero_nt(ptr, count); }
 
 	static void *memcpy(void *dest, const void *src, size_t size) { return Impl::memcpy(dest, src, size); }
 	static void *memset(void *dest, int c, size_t size) { return Impl::memset(dest, c, size); }
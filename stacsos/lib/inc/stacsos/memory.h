@@ -8,6 +8,7 @@
 #pragma once
 
 #include <stacsos/helpers.h>
+#include <stacsos/node-storage.h>
 
 namespace stacsos {
 template <class T> class unique_ptr {
@@ -171,7 +172,7 @@ private:
 	void acquire()
 	{
 		if (refcount_ == nullptr) {
-			refcount_ = new u64(1);
+			refcount_ = new (allocate_node_storage(sizeof(u64))) u64(1);
 		} else {
 			(*refcount_)++;
 		}
@@ -188,7 +189,7 @@ private:
 					ptr_ = nullptr;
 				}
 
-				delete refcount_;
+				free_node_storage(refcount_, sizeof(u64));
 				refcount_ = nullptr;
 			}
 		}
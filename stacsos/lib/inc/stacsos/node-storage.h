@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+/**
+ * Storage for the small nodes that the library containers allocate (list and tree
+ * nodes, and shared_ptr reference counts).  These don't go through operator new,
+ * so that the kernel can keep them in caches of exactly the right size.  In user
+ * programs they come from the heap.
+ */
+void *allocate_node_storage(size_t size);
+void free_node_storage(void *ptr, size_t size);
+
+/**
+ * Resizes an array allocated with new[], of a type that can be moved with memcpy
+ * (and so has no array cookie), for containers whose storage grows.  The kernel can
+ * often do this in place.  The contents, up to the smaller of the two sizes, are
+ * kept.
+ *
+ * @return - The resized array, or nullptr if there was no memory, in which case the
+ * original array is left alone
+ */
+void *reallocate_storage(void *ptr, size_t old_size, size_t new_size);
+} // namespace stacsos
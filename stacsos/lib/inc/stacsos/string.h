@@ -9,6 +9,7 @@
 
 #include <stacsos/list.h>
 #include <stacsos/memops.h>
+#include <stacsos/node-storage.h>
 
 namespace stacsos {
 enum class pad_side { LEFT, RIGHT };
@@ -123,12 +124,14 @@ public:
 	friend string &operator+=(string &s, const char_type &ch)
 	{
 		size_t new_size = s.size_ + 1;
-		char_type *new_data = new char_type[new_size + 1];
-		memops::memcpy(new_data, s.data_, s.size_);
+		char_type *new_data = (char_type *)reallocate_storage(s.data_, s.size_ + 1, new_size + 1);
+		if (!new_data) {
+			return s;
+		}
+
 		new_data[new_size - 1] = ch;
 		new_data[new_size] = 0;
 
-		delete s.data_;
 		s.data_ = new_data;
 		s.size_ = new_size;
 		s.has_hash_ = false;
@@ -139,14 +142,17 @@ public:
 	friend string &operator+=(string &l, const string &r)
 	{
 		size_t new_size = l.size_ + r.size_;
-		char_type *new_data = new char_type[new_size + 1];
 
-		memops::memcpy(new_data, l.data_, l.size_);
-		memops::memcpy(new_data + l.size_, r.data_, r.size_);
+		// If r is l, its data may have been moved by the reallocation.
+		char_type *new_data = (char_type *)reallocate_storage(l.data_, l.size_ + 1, new_size + 1);
+		if (!new_data) {
+			return l;
+		}
+
+		memops::memcpy(new_data + l.size_, &l == &r ? new_data : r.data_, r.size_);
 
 		new_data[new_size] = 0;
 
-		delete l.data_;
 		l.data_ = new_data;
 		l.size_ = new_size;
 		l.has_hash_ = false;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stacsos/node-storage.h>
+
 namespace stacsos {
 template <class T> class vector {
 public:
@@ -47,16 +49,30 @@ public:
 
 	size_t size() const { return size_; }
 
+	/**
+	 * Resizes the vector.  The storage for types that can be moved with memcpy is
+	 * reallocated, which can often be done in place, rather than copied.  If there
+	 * isn't enough memory, the vector is left as it was.
+	 */
 	void resize(size_t new_size)
 	{
-		T *new_storage_ = new T[new_size];
-		for (unsigned long i = 0; i < size_; i++) {
-			new_storage_[i] = storage_[i];
-		}
+		if constexpr (__is_trivially_copyable(T)) {
+			T *new_storage = (T *)reallocate_storage(storage_, size_ * sizeof(T), new_size * sizeof(T));
+			if (!new_storage && new_size) {
+				return;
+			}
 
-		T *tmp = storage_;
-		storage_ = new_storage_;
-		delete tmp;
+			storage_ = new_storage;
+		} else {
+			T *new_storage_ = new T[new_size];
+			for (unsigned long i = 0; i < size_ && i < new_size; i++) {
+				new_storage_[i] = storage_[i];
+			}
+
+			T *tmp = storage_;
+			storage_ = new_storage_;
+			delete[] tmp;
+		}
 
 		size_ = new_size;
 	}
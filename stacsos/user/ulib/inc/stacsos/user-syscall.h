@@ -76,6 +76,8 @@ public:
 		return alloc_result { r.code, (void *)r.data };
 	}
 
+	static syscall_result free_mem(void *ptr, u64 size) { return syscall2(syscall_numbers::free_mem, (u64)ptr, size); }
+
 	static syscall_result start_process(const char *path, const char *args) { return syscall2(syscall_numbers::start_process, (u64)path, (u64)args); }
 	static syscall_result wait_process(u64 id) { return syscall1(syscall_numbers::wait_for_process, id); }
 
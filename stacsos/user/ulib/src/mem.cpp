@@ -5,6 +5,8 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/memops.h>
+#include <stacsos/node-storage.h>
 #include <stacsos/user-syscall.h>
 
 extern "C" {
@@ -15,9 +17,14 @@ int __cxa_atexit(void (*destructor)(void *), void *arg, void *dso) { return 0; }
 struct memory_block;
 static memory_block *free_list;
 
+// Allocations of at least this size get a region of their own, which is given back
+// to the kernel when they are freed.
+static const size_t large_block_size = 0x10000;
+
 struct memory_block {
 	memory_block *next, *prev;
 	size_t size;
+	bool large;
 
 	void remove()
 	{
@@ -48,23 +55,47 @@ struct memory_block {
 		memory_block *new_block = (memory_block *)((u64)this + size + sizeof(memory_block));
 		new_block->next = nullptr;
 		new_block->prev = nullptr;
-		new_block->size = orig_size - size;
+		new_block->size = orig_size - size - sizeof(memory_block);
+		new_block->large = false;
 
 		return new_block;
 	}
 
-	void *ptr() { return (void *)((u64)this + sizeof(this)); }
+	void *ptr() { return (void *)((u64)this + sizeof(memory_block)); }
+
+	static memory_block *from_ptr(void *ptr) { return (memory_block *)((u64)ptr - sizeof(memory_block)); }
 };
 
+static void *allocate_large(size_t size)
+{
+	size_t new_size = (size + sizeof(memory_block) + 0xfff) & ~0xfff;
+	auto alloc_result = stacsos::syscalls::alloc_mem(new_size);
+	if (alloc_result.code != stacsos::syscall_result_code::ok) {
+		return nullptr;
+	}
+
+	memory_block *block = (memory_block *)alloc_result.ptr;
+	block->next = nullptr;
+	block->prev = nullptr;
+	block->size = new_size - sizeof(memory_block);
+	block->large = true;
+
+	return block->ptr();
+}
+
 static void *allocate(size_t size)
 {
+	if (size >= large_block_size) {
+		return allocate_large(size);
+	}
+
 	memory_block *candidate_block = free_list;
 
 	while (candidate_block) {
 		if (candidate_block->size >= size) {
 			candidate_block->remove();
 
-			if (candidate_block->size > size) {
+			if (candidate_block->size > size + sizeof(memory_block)) {
 				memory_block *new_block = candidate_block->split(size);
 				new_block->insert();
 			}
@@ -85,8 +116,9 @@ static void *allocate(size_t size)
 	candidate_block->next = nullptr;
 	candidate_block->prev = nullptr;
 	candidate_block->size = new_size - sizeof(memory_block);
+	candidate_block->large = false;
 
-	if (new_size > size) {
+	if (candidate_block->size > size + sizeof(memory_block)) {
 		memory_block *new_block = candidate_block->split(size);
 		new_block->insert();
 	}
@@ -96,7 +128,14 @@ static void *allocate(size_t size)
 
 void free(void *ptr)
 {
-	//
+	if (!ptr) {
+		return;
+	}
+
+	memory_block *block = memory_block::from_ptr(ptr);
+	if (block->large) {
+		stacsos::syscalls::free_mem(block, block->size + sizeof(memory_block));
+	}
 }
 
 void *operator new(size_t size) { return allocate(size); }
@@ -110,3 +149,23 @@ void operator delete[](void *p) { operator delete(p); }
 void operator delete[](void *p, size_t sz) { operator delete(p); }
 
 void operator delete(void *p, size_t sz) { operator delete(p); }
+
+void *stacsos::allocate_node_storage(size_t size) { return allocate(size); }
+
+void stacsos::free_node_storage(void *ptr, size_t size) { free(ptr); }
+
+void *stacsos::reallocate_storage(void *ptr, size_t old_size, size_t new_size)
+{
+	void *new_ptr = allocate(new_size);
+	if (!new_ptr) {
+		return nullptr;
+	}
+
+	// Like a fresh allocation if there's nothing to copy (e.g. a moved-from string).
+	if (ptr) {
+		stacsos::memops::memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+		free(ptr);
+	}
+
+	return new_ptr;
+}